@@ -36,6 +36,8 @@ struct input_handle {
 	int flushing;
 	int got_frame;
 	int packet_left;
+	/* frame requested by the last seek, until it has been reached */
+	int64_t seek_target;
 	float buffer[BUFFER_SIZE / 2 + 1];
 };
 
@@ -82,6 +84,11 @@ ffmpeg_open_file(struct input_handle *ih, char const *filename)
 	g_mutex_lock(&ffmpeg_mutex);
 	ih->format_context = NULL;
 
+	/* "-" is stdin, which FFmpeg reads through its pipe protocol */
+	if (!strcmp(filename, "-")) {
+		filename = "pipe:0";
+	}
+
 	if (avformat_open_input(&ih->format_context, filename, NULL, NULL) !=
 	    0) {
 		fprintf(stderr, "Could not open input file!\n");
@@ -167,6 +174,7 @@ ffmpeg_open_file(struct input_handle *ih, char const *filename)
 	ih->flushing = 0;
 	ih->got_frame = 0;
 	ih->packet_left = 0;
+	ih->seek_target = -1;
 
 	return 0;
 
@@ -399,10 +407,121 @@ out:
 	return (size_t)nr_frames_read;
 }
 
+/* position of the first sample of the decoded frame, AV_NOPTS_VALUE if it
+ * is unknown */
+static int64_t
+get_frame_position(struct input_handle *ih)
+{
+	AVStream *stream = ih->format_context->streams[ih->audio_stream];
+	AVRational sample_time_base = { 1, ih->codec_context->sample_rate };
+	int64_t timestamp = ih->frame->best_effort_timestamp;
+
+	if (timestamp == AV_NOPTS_VALUE) {
+		return AV_NOPTS_VALUE;
+	}
+	if (stream->start_time != AV_NOPTS_VALUE) {
+		timestamp -= stream->start_time;
+	}
+	return av_rescale_q(timestamp, stream->time_base, sample_time_base);
+}
+
+/* After a seek, decoding starts at the seek point before the requested
+ * frame. The frames before it are dropped, so that they don't count as
+ * part of what was asked for. */
 static size_t
 ffmpeg_read_frames(struct input_handle *ih)
 {
-	return ffmpeg_read_one_packet(ih);
+	size_t nr_frames_read;
+
+	while ((nr_frames_read = ffmpeg_read_one_packet(ih)) &&
+	    ih->seek_target >= 0) {
+		int64_t position = get_frame_position(ih);
+		size_t skip;
+
+		if (position == AV_NOPTS_VALUE ||
+		    position >= ih->seek_target) {
+			ih->seek_target = -1;
+			break;
+		}
+		skip = (size_t)(ih->seek_target - position);
+		if (skip < nr_frames_read) {
+			size_t channels = (size_t)ih->codec_context->channels;
+
+			memmove(ih->buffer, ih->buffer + skip * channels,
+			    (nr_frames_read - skip) * channels *
+				sizeof *ih->buffer);
+			ih->seek_target = -1;
+			return nr_frames_read - skip;
+		}
+	}
+	return nr_frames_read;
+}
+
+/* Seeks to the nearest seek point before 'frame'; ffmpeg_read_frames()
+ * then drops the frames up to 'frame'. */
+static int
+ffmpeg_seek_frames(struct input_handle *ih, size_t frame)
+{
+	AVStream *stream = ih->format_context->streams[ih->audio_stream];
+	AVRational sample_time_base = { 1, ih->codec_context->sample_rate };
+	int64_t timestamp = av_rescale_q((int64_t)frame, sample_time_base,
+	    stream->time_base);
+
+	if (stream->start_time != AV_NOPTS_VALUE) {
+		timestamp += stream->start_time;
+	}
+	if (av_seek_frame(ih->format_context, ih->audio_stream, timestamp,
+		AVSEEK_FLAG_BACKWARD) < 0) {
+		return 1;
+	}
+
+	if (ih->packet_left) {
+		av_free_packet(&ih->orig_packet);
+		ih->packet_left = 0;
+	}
+	avcodec_flush_buffers(ih->codec_context);
+	ih->flushing = 0;
+	ih->got_frame = 0;
+	ih->seek_target = (int64_t)frame;
+
+	return 0;
+}
+
+static size_t
+ffmpeg_get_chapters(struct input_handle *ih, struct input_chapter **chapters)
+{
+	AVFormatContext *format_context = ih->format_context;
+	AVStream *stream = format_context->streams[ih->audio_stream];
+	AVRational sample_time_base = { 1, ih->codec_context->sample_rate };
+	int64_t offset = 0;
+	unsigned i;
+
+	*chapters = NULL;
+	if (!format_context->nb_chapters) {
+		return 0;
+	}
+	*chapters = malloc(format_context->nb_chapters * sizeof **chapters);
+	if (!*chapters) {
+		return 0;
+	}
+
+	/* frames are counted from the first decoded sample */
+	if (stream->start_time != AV_NOPTS_VALUE) {
+		offset = av_rescale_q(stream->start_time, stream->time_base,
+		    sample_time_base);
+	}
+	for (i = 0; i < format_context->nb_chapters; ++i) {
+		AVChapter *chapter = format_context->chapters[i];
+		AVDictionaryEntry *title = av_dict_get(chapter->metadata,
+		    "title", NULL, 0);
+		int64_t start = av_rescale_q(chapter->start,
+				    chapter->time_base, sample_time_base) -
+		    offset;
+
+		(*chapters)[i].start = start > 0 ? (size_t)start : 0;
+		(*chapters)[i].title = title ? strdup(title->value) : NULL;
+	}
+	return format_context->nb_chapters;
 }
 
 static void
@@ -438,13 +557,16 @@ ffmpeg_exit_library(void)
 
 #pragma GCC diagnostic pop
 
-G_MODULE_EXPORT struct input_ops ip_ops = { ffmpeg_get_channels,
-	ffmpeg_get_samplerate, ffmpeg_get_buffer, ffmpeg_handle_init,
-	ffmpeg_handle_destroy, ffmpeg_open_file, ffmpeg_set_channel_map,
-	ffmpeg_allocate_buffer, ffmpeg_get_total_frames, ffmpeg_read_frames,
+G_MODULE_EXPORT struct input_ops INPUT_PLUGIN_SYMBOL(ffmpeg, ip_ops) = {
+	ffmpeg_get_channels, ffmpeg_get_samplerate, ffmpeg_get_buffer,
+	ffmpeg_handle_init, ffmpeg_handle_destroy, ffmpeg_open_file,
+	ffmpeg_set_channel_map, ffmpeg_allocate_buffer, ffmpeg_get_total_frames,
+	ffmpeg_read_frames, ffmpeg_seek_frames, ffmpeg_get_chapters,
 	ffmpeg_free_buffer, ffmpeg_close_file, ffmpeg_init_library,
-	ffmpeg_exit_library };
+	ffmpeg_exit_library
+};
 
-G_MODULE_EXPORT char const *ip_exts[] = { "wav", "flac", "ogg", "oga", "mp3",
-	"mp2", "mpc", "ac3", "wv", "mpg", "avi", "mkv", "m4a", "mp4", "aac",
-	"mov", "mxf", "opus", "w64", NULL };
+G_MODULE_EXPORT char const *INPUT_PLUGIN_SYMBOL(ffmpeg, ip_exts)[] = {
+	"wav", "flac", "ogg", "oga", "mp3", "mp2", "mpc", "ac3", "wv", "mpg",
+	"avi", "mkv", "m4a", "mp4", "aac", "mov", "mxf", "opus", "w64", NULL
+};
@@ -1,22 +1,89 @@
 /* See COPYING file for copyright and license details. */
 
 #include "input.h"
+#include "input_raw.h"
 
 #include <gmodule.h>
 #include <stdio.h>
 
-static char const *plugin_names[] = { "input_ffmpeg", "input_sndfile", NULL };
+/* Files are tried in this order, so libsndfile, which starts up far faster
+ * than FFmpeg, reads the formats it knows and FFmpeg the rest. Stdin can
+ * only be read once and is probed in the opposite order, FFmpeg first, as
+ * it reads every format. */
+static char const *plugin_names[] = { "input_sndfile", "input_ffmpeg", NULL };
 
 static char const *plugin_search_dirs[] = { ".", "r128", "",
 	NULL, /* = g_path_get_dirname(av0); */
 	NULL };
 
+#ifdef STATIC_INPUT_FFMPEG
+extern struct input_ops ffmpeg_ip_ops;
+extern char const *ffmpeg_ip_exts[];
+#endif
+#ifdef STATIC_INPUT_SNDFILE
+extern struct input_ops sndfile_ip_ops;
+extern char const *sndfile_ip_exts[];
+#endif
+
+/* plugins linked into the executable (ENABLE_STATIC_PLUGINS) */
+static struct {
+	char const *name;
+	struct input_ops *ops;
+	char const **exts;
+} const static_plugins[] = {
+#ifdef STATIC_INPUT_FFMPEG
+	{ "input_ffmpeg", &ffmpeg_ip_ops, ffmpeg_ip_exts },
+#endif
+#ifdef STATIC_INPUT_SNDFILE
+	{ "input_sndfile", &sndfile_ip_ops, sndfile_ip_exts },
+#endif
+	{ NULL, NULL, NULL },
+};
+
 static GSList *g_modules;
 static GSList *plugin_ops; /*struct input_ops* ops;*/
 static GSList *plugin_exts;
+static GSList *plugin_display_names;
+
+/* Plugin libraries are initialised on first use by input_get_ops(), so a
+ * batch of WAV files never initialises FFmpeg. With --verbose, the time
+ * each initialisation takes is printed. */
+static GMutex init_mutex;
+static GSList *initialized_ops;
 
 extern int verbose;
 static int plugin_forced;
+static int raw_input;
+
+static void
+find_static_plugin(char const *plugin, struct input_ops **ops, char ***exts)
+{
+	int i;
+	for (i = 0; static_plugins[i].name; ++i) {
+		if (!strcmp(static_plugins[i].name, plugin)) {
+			*ops = static_plugins[i].ops;
+			*exts = (char **)static_plugins[i].exts;
+			return;
+		}
+	}
+}
+
+static char **
+get_r128_search_path(void)
+{
+	char const *env_path = g_getenv("PATH");
+	char **env_path_split;
+	char **it;
+
+	env_path_split = g_strsplit(env_path ? env_path : "",
+	    G_SEARCHPATH_SEPARATOR_S, 0);
+	for (it = env_path_split; *it; ++it) {
+		char *r128_path = g_build_filename(*it, "r128", NULL);
+		g_free(*it);
+		*it = r128_path;
+	}
+	return env_path_split;
+}
 
 static void
 search_module_in_paths(char const *plugin, GModule **module,
@@ -33,6 +100,16 @@ search_module_in_paths(char const *plugin, GModule **module,
 	}
 }
 
+int
+input_set_raw_format(char const *spec)
+{
+	if (input_raw_parse_format(spec)) {
+		return 1;
+	}
+	raw_input = 1;
+	return 0;
+}
+
 int
 input_init(char *exe_name, char const *forced_plugin)
 {
@@ -41,20 +118,12 @@ input_init(char *exe_name, char const *forced_plugin)
 	struct input_ops *ops;
 	char **exts;
 	GModule *module;
-	char *exe_dir;
-	char const *env_path;
-	char **env_path_split;
-	char **it;
-
-	exe_dir = g_path_get_dirname(exe_name);
-	plugin_search_dirs[3] = exe_dir;
+	char *exe_dir = NULL;
+	char **env_path_split = NULL;
 
-	env_path = g_getenv("PATH");
-	env_path_split = g_strsplit(env_path, G_SEARCHPATH_SEPARATOR_S, 0);
-	for (it = env_path_split; *it; ++it) {
-		char *r128_path = g_build_filename(*it, "r128", NULL);
-		g_free(*it);
-		*it = r128_path;
+	/* raw input needs no plugins at all */
+	if (raw_input) {
+		return raw_ip_ops.init_library();
 	}
 
 	if (forced_plugin) {
@@ -70,10 +139,18 @@ input_init(char *exe_name, char const *forced_plugin)
 		ops = NULL;
 		exts = NULL;
 		module = NULL;
-		search_module_in_paths(*cur_plugin_name, &module,
-		    plugin_search_dirs);
-		search_module_in_paths(*cur_plugin_name, &module,
-		    (char const *const *)env_path_split);
+		find_static_plugin(*cur_plugin_name, &ops, &exts);
+		if (!ops && !env_path_split) {
+			exe_dir = g_path_get_dirname(exe_name);
+			plugin_search_dirs[3] = exe_dir;
+			env_path_split = get_r128_search_path();
+		}
+		if (!ops) {
+			search_module_in_paths(*cur_plugin_name, &module,
+			    plugin_search_dirs);
+			search_module_in_paths(*cur_plugin_name, &module,
+			    (char const *const *)env_path_split);
+		}
 		if (!module) {
 			/* fprintf(stderr, "%s\n", g_module_error()); */
 		} else {
@@ -93,12 +170,13 @@ input_init(char *exe_name, char const *forced_plugin)
 				fprintf(stderr, "found plugin %s\n",
 				    *cur_plugin_name);
 			}
-			ops->init_library();
 			plugin_found = 1;
 		}
 		g_modules = g_slist_append(g_modules, module);
 		plugin_ops = g_slist_append(plugin_ops, ops);
 		plugin_exts = g_slist_append(plugin_exts, exts);
+		plugin_display_names = g_slist_append(plugin_display_names,
+		    (gpointer)*cur_plugin_name);
 		++cur_plugin_name;
 	}
 
@@ -115,55 +193,103 @@ int
 input_deinit(void)
 {
 	/* unload plugins */
-	GSList *ops = plugin_ops;
+	GSList *ops = initialized_ops;
 	GSList *modules = g_modules;
 
-	while (ops && modules) {
-		if (ops->data && modules->data) {
-			((struct input_ops *)ops->data)->exit_library();
-			if (!g_module_close((GModule *)modules->data)) {
-				fprintf(stderr, "%s\n", g_module_error());
-			}
-		}
+	if (raw_input) {
+		raw_ip_ops.exit_library();
+	}
+	while (ops) {
+		((struct input_ops *)ops->data)->exit_library();
 		ops = g_slist_next(ops);
+	}
+	while (modules) {
+		if (modules->data &&
+		    !g_module_close((GModule *)modules->data)) {
+			fprintf(stderr, "%s\n", g_module_error());
+		}
 		modules = g_slist_next(modules);
 	}
+	g_slist_free(initialized_ops);
 	g_slist_free(g_modules);
 	g_slist_free(plugin_ops);
 	g_slist_free(plugin_exts);
+	g_slist_free(plugin_display_names);
 	return 0;
 }
 
+static struct input_ops *
+init_plugin_once(struct input_ops *ops, char const *name)
+{
+	gint64 start;
+
+	g_mutex_lock(&init_mutex);
+	if (!g_slist_find(initialized_ops, ops)) {
+		start = g_get_monotonic_time();
+		ops->init_library();
+		if (verbose) {
+			fprintf(stderr, "initialised plugin %s in %.1f ms\n",
+			    name, (double)(g_get_monotonic_time() - start) /
+				1000.0);
+		}
+		initialized_ops = g_slist_prepend(initialized_ops, ops);
+	}
+	g_mutex_unlock(&init_mutex);
+	return ops;
+}
+
 struct input_ops *
-input_get_ops(char const *filename)
+input_get_next_ops(char const *filename, struct input_ops *previous)
 {
 	static char empty[] = { '\0' };
-	GSList *ops = plugin_ops;
-	GSList *exts = plugin_exts;
 	char *filename_ext = strrchr(filename, '.');
+	gboolean is_stdin = !strcmp(filename, "-");
+	guint nr_plugins = g_slist_length(plugin_ops);
+	guint i;
 
+	if (raw_input) {
+		return previous ? NULL : &raw_ip_ops;
+	}
 	if (filename_ext) {
 		++filename_ext;
 	} else {
 		filename_ext = &empty[0];
 	}
-	while (ops && exts) {
-		if (ops->data && exts->data) {
-			char const **cur_exts = exts->data;
-			if (!(*cur_exts)) {
-				return (struct input_ops *)ops->data;
+	for (i = 0; i < nr_plugins; ++i) {
+		guint index = is_stdin ? nr_plugins - 1 - i : i;
+		struct input_ops *ops = g_slist_nth_data(plugin_ops, index);
+		char const **cur_exts = g_slist_nth_data(plugin_exts, index);
+		char const *name = g_slist_nth_data(plugin_display_names,
+		    index);
+
+		/* skip up to and including the plugin tried last */
+		if (previous) {
+			if (ops == previous) {
+				previous = NULL;
 			}
-			while (*cur_exts) {
-				if (!g_ascii_strcasecmp(filename_ext,
-					*cur_exts) ||
-				    plugin_forced) {
-					return (struct input_ops *)ops->data;
-				}
-				++cur_exts;
+			continue;
+		}
+		if (!ops || !cur_exts) {
+			continue;
+		}
+		/* no extension to go by for stdin, so each plugin gets to
+		 * probe its input in turn */
+		if (!(*cur_exts) || is_stdin) {
+			return init_plugin_once(ops, name);
+		}
+		while (*cur_exts) {
+			if (!g_ascii_strcasecmp(filename_ext, *cur_exts) ||
+			    plugin_forced) {
+				return init_plugin_once(ops, name);
 			}
+			++cur_exts;
 		}
-		ops = g_slist_next(ops);
-		exts = g_slist_next(exts);
 	}
 	return NULL;
 }
+
+struct input_ops *
+input_get_ops(char const *filename)
+{
+	return input_get_next_ops(filename, NULL);
+}
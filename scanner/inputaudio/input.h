@@ -7,6 +7,13 @@
 
 struct input_handle;
 
+/* A chapter of the open file, starting at frame 'start'. 'title' may be
+ * NULL. */
+struct input_chapter {
+	size_t start;
+	char *title;
+};
+
 struct input_ops {
 	unsigned (*get_channels)(struct input_handle *ih);
 	unsigned long (*get_samplerate)(struct input_handle *ih);
@@ -18,15 +25,36 @@ struct input_ops {
 	int (*allocate_buffer)(struct input_handle *ih);
 	size_t (*get_total_frames)(struct input_handle *ih);
 	size_t (*read_frames)(struct input_handle *ih);
+	int (*seek_frames)(struct input_handle *ih, size_t frame);
+	/* Returns the number of chapters and stores them in a malloc'ed
+	 * array, whose titles the caller frees as well. May be NULL. */
+	size_t (*get_chapters)(struct input_handle *ih,
+	    struct input_chapter **chapters);
 	void (*free_buffer)(struct input_handle *ih);
 	void (*close_file)(struct input_handle *ih);
 	int (*init_library)(void);
 	void (*exit_library)(void);
 };
 
+/* Plugins export their ops as 'ip_ops' and their NULL terminated extension
+ * list as 'ip_exts'. Statically linked plugins prefix both names with the
+ * plugin name instead, see ENABLE_STATIC_PLUGINS. */
+#ifdef INPUT_STATIC_PLUGIN
+#define INPUT_PLUGIN_SYMBOL(plugin, symbol) plugin##_##symbol
+#else
+#define INPUT_PLUGIN_SYMBOL(plugin, symbol) symbol
+#endif
+
 int input_init(char *exe_name, char const *forced_plugin);
+/* Read all input as raw PCM described by spec, e.g.
+ * "f32le:48000:6:L,R,C,LFE,Ls,Rs". Must be called before input_init(). */
+int input_set_raw_format(char const *spec);
 int input_deinit(void);
 struct input_ops *input_get_ops(char const *filename);
+/* Returns the plugin to try after 'previous' failed to open the file, or
+ * NULL if there is none left. */
+struct input_ops *input_get_next_ops(char const *filename,
+    struct input_ops *previous);
 
 int input_open_fd(char const *filename);
 void input_close_fd(int fd);
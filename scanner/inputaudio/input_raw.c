@@ -0,0 +1,380 @@
+/* See COPYING file for copyright and license details. */
+
+#include "input_raw.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef G_OS_WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "ebur128.h"
+
+enum raw_sample_type { RAW_S16, RAW_S32, RAW_F32, RAW_F64 };
+
+static struct {
+	enum raw_sample_type type;
+	size_t sample_size;
+	int swap; /* byte order differs from the host */
+	unsigned long samplerate;
+	unsigned channels;
+	int *channel_map; /* NULL: libebur128's default map */
+} raw_format;
+
+struct input_handle {
+	int fd;
+	size_t total_frames;
+	size_t buffer_frames;
+	float *buffer;
+	char *raw_buffer;
+};
+
+static struct {
+	char const *name;
+	int channel;
+} const raw_channel_names[] = {
+	{ "L", EBUR128_LEFT },
+	{ "R", EBUR128_RIGHT },
+	{ "C", EBUR128_CENTER },
+	{ "LFE", EBUR128_UNUSED },
+	{ "Ls", EBUR128_LEFT_SURROUND },
+	{ "Rs", EBUR128_RIGHT_SURROUND },
+	{ "DM", EBUR128_DUAL_MONO },
+	{ "-", EBUR128_UNUSED },
+	{ NULL, 0 },
+};
+
+static int
+parse_sample_type(char const *type)
+{
+	int big_endian;
+
+	if (g_str_has_suffix(type, "le")) {
+		big_endian = 0;
+	} else if (g_str_has_suffix(type, "be")) {
+		big_endian = 1;
+	} else {
+		return 1;
+	}
+
+	if (!strncmp(type, "s16", 3)) {
+		raw_format.type = RAW_S16;
+		raw_format.sample_size = 2;
+	} else if (!strncmp(type, "s32", 3)) {
+		raw_format.type = RAW_S32;
+		raw_format.sample_size = 4;
+	} else if (!strncmp(type, "f32", 3)) {
+		raw_format.type = RAW_F32;
+		raw_format.sample_size = 4;
+	} else if (!strncmp(type, "f64", 3)) {
+		raw_format.type = RAW_F64;
+		raw_format.sample_size = 8;
+	} else {
+		return 1;
+	}
+	if (strlen(type) != 5) {
+		return 1;
+	}
+
+	raw_format.swap = big_endian != (G_BYTE_ORDER == G_BIG_ENDIAN);
+	return 0;
+}
+
+static int
+parse_channel_layout(char const *layout)
+{
+	gchar **names = g_strsplit(layout, ",", -1);
+	unsigned i;
+	int rc = 1;
+
+	if (g_strv_length(names) != raw_format.channels) {
+		goto out;
+	}
+	raw_format.channel_map = g_new(int, raw_format.channels);
+	for (i = 0; i < raw_format.channels; ++i) {
+		int j;
+		for (j = 0; raw_channel_names[j].name; ++j) {
+			if (!g_ascii_strcasecmp(names[i],
+				raw_channel_names[j].name)) {
+				break;
+			}
+		}
+		if (!raw_channel_names[j].name) {
+			goto out;
+		}
+		raw_format.channel_map[i] = raw_channel_names[j].channel;
+	}
+	rc = 0;
+
+out:
+	g_strfreev(names);
+	return rc;
+}
+
+int
+input_raw_parse_format(char const *spec)
+{
+	gchar **elements = g_strsplit(spec, ":", 4);
+	gchar *endptr;
+	guint64 value;
+	int rc = 1;
+
+	if (g_strv_length(elements) < 3) {
+		goto out;
+	}
+	if (parse_sample_type(elements[0])) {
+		goto out;
+	}
+
+	value = g_ascii_strtoull(elements[1], &endptr, 10);
+	if (endptr == elements[1] || *endptr != '\0' || value == 0) {
+		goto out;
+	}
+	raw_format.samplerate = (unsigned long)value;
+
+	value = g_ascii_strtoull(elements[2], &endptr, 10);
+	if (endptr == elements[2] || *endptr != '\0' || value == 0 ||
+	    value > 64) {
+		goto out;
+	}
+	raw_format.channels = (unsigned)value;
+
+	if (elements[3] && parse_channel_layout(elements[3])) {
+		goto out;
+	}
+	rc = 0;
+
+out:
+	g_strfreev(elements);
+	return rc;
+}
+
+static unsigned
+raw_get_channels(struct input_handle *ih)
+{
+	(void)ih;
+	return raw_format.channels;
+}
+
+static unsigned long
+raw_get_samplerate(struct input_handle *ih)
+{
+	(void)ih;
+	return raw_format.samplerate;
+}
+
+static float *
+raw_get_buffer(struct input_handle *ih)
+{
+	return ih->buffer;
+}
+
+static struct input_handle *
+raw_handle_init()
+{
+	struct input_handle *ret;
+	ret = malloc(sizeof(struct input_handle));
+	memset(ret, '\0', sizeof(struct input_handle));
+	ret->fd = -1;
+	return ret;
+}
+
+static void
+raw_handle_destroy(struct input_handle **ih)
+{
+	free(*ih);
+	*ih = NULL;
+}
+
+static int
+raw_open_file(struct input_handle *ih, char const *filename)
+{
+	GStatBuf stat_buf;
+
+	if (!strcmp(filename, "-")) {
+		ih->fd = 0;
+#ifdef G_OS_WIN32
+		/* raw samples must not go through CRLF translation */
+		_setmode(ih->fd, _O_BINARY);
+#endif
+		ih->total_frames = 0;
+		return 0;
+	}
+
+	ih->fd = input_open_fd(filename);
+	if (ih->fd < 0) {
+		return 1;
+	}
+	/* the length follows from the file size, nothing needs probing */
+	if (!g_stat(filename, &stat_buf) && S_ISREG(stat_buf.st_mode)) {
+		ih->total_frames = (size_t)stat_buf.st_size /
+		    (raw_format.sample_size * raw_format.channels);
+	}
+	return 0;
+}
+
+static int
+raw_set_channel_map(struct input_handle *ih, int *st)
+{
+	(void)ih;
+	if (!raw_format.channel_map) {
+		return 1;
+	}
+	memcpy(st, raw_format.channel_map, raw_format.channels * sizeof(int));
+	return 0;
+}
+
+static int
+raw_allocate_buffer(struct input_handle *ih)
+{
+	/* 100ms per read keeps the latency on pipes low */
+	ih->buffer_frames = raw_format.samplerate / 10 + 1;
+	ih->buffer = malloc(ih->buffer_frames * raw_format.channels *
+	    sizeof(float));
+	if (!ih->buffer) {
+		return 1;
+	}
+	/* native float samples are read straight into the float buffer */
+	if (raw_format.type != RAW_F32) {
+		ih->raw_buffer = malloc(ih->buffer_frames *
+		    raw_format.channels * raw_format.sample_size);
+		if (!ih->raw_buffer) {
+			free(ih->buffer);
+			ih->buffer = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static size_t
+raw_get_total_frames(struct input_handle *ih)
+{
+	return ih->total_frames;
+}
+
+static size_t
+raw_read_frames(struct input_handle *ih)
+{
+	size_t frame_size = raw_format.sample_size * raw_format.channels;
+	size_t bytes_wanted = ih->buffer_frames * frame_size;
+	size_t bytes_read = 0;
+	char *raw = ih->raw_buffer ? ih->raw_buffer : (char *)ih->buffer;
+	size_t nr_samples;
+	size_t i;
+
+	while (bytes_read < bytes_wanted) {
+		int ret = input_read_fd(ih->fd, raw + bytes_read,
+		    (unsigned int)(bytes_wanted - bytes_read));
+		if (ret <= 0) {
+			break;
+		}
+		bytes_read += (size_t)ret;
+	}
+	/* a trailing partial frame at the end of input is dropped */
+	nr_samples = bytes_read / frame_size * raw_format.channels;
+
+	switch (raw_format.type) {
+	case RAW_S16:
+		for (i = 0; i < nr_samples; ++i) {
+			guint16 s;
+			memcpy(&s, raw + i * 2, 2);
+			if (raw_format.swap) {
+				s = GUINT16_SWAP_LE_BE(s);
+			}
+			ih->buffer[i] = (float)(gint16)s / 32768.0f;
+		}
+		break;
+	case RAW_S32:
+		for (i = 0; i < nr_samples; ++i) {
+			guint32 s;
+			memcpy(&s, raw + i * 4, 4);
+			if (raw_format.swap) {
+				s = GUINT32_SWAP_LE_BE(s);
+			}
+			ih->buffer[i] = (float)(gint32)s / 2147483648.0f;
+		}
+		break;
+	case RAW_F32:
+		if (raw_format.swap) {
+			guint32 *s = (guint32 *)ih->buffer;
+			for (i = 0; i < nr_samples; ++i) {
+				s[i] = GUINT32_SWAP_LE_BE(s[i]);
+			}
+		}
+		break;
+	case RAW_F64:
+		for (i = 0; i < nr_samples; ++i) {
+			guint64 s;
+			double d;
+			memcpy(&s, raw + i * 8, 8);
+			if (raw_format.swap) {
+				s = GUINT64_SWAP_LE_BE(s);
+			}
+			memcpy(&d, &s, 8);
+			ih->buffer[i] = (float)d;
+		}
+		break;
+	}
+
+	return nr_samples / raw_format.channels;
+}
+
+static int
+raw_seek_frames(struct input_handle *ih, size_t frame)
+{
+	gint64 offset;
+
+	if (!ih->total_frames) {
+		return 1;
+	}
+	offset = (gint64)(frame * raw_format.sample_size * raw_format.channels);
+#ifdef G_OS_WIN32
+	return _lseeki64(ih->fd, offset, SEEK_SET) < 0;
+#else
+	return lseek(ih->fd, (off_t)offset, SEEK_SET) < 0;
+#endif
+}
+
+static void
+raw_free_buffer(struct input_handle *ih)
+{
+	free(ih->buffer);
+	ih->buffer = NULL;
+	free(ih->raw_buffer);
+	ih->raw_buffer = NULL;
+}
+
+static void
+raw_close_file(struct input_handle *ih)
+{
+	if (ih->fd > 0) {
+		input_close_fd(ih->fd);
+	}
+	ih->fd = -1;
+}
+
+static int
+raw_init_library(void)
+{
+	return 0;
+}
+
+static void
+raw_exit_library(void)
+{
+	g_free(raw_format.channel_map);
+	raw_format.channel_map = NULL;
+}
+
+struct input_ops raw_ip_ops = { raw_get_channels, raw_get_samplerate,
+	raw_get_buffer, raw_handle_init, raw_handle_destroy, raw_open_file,
+	raw_set_channel_map, raw_allocate_buffer, raw_get_total_frames,
+	raw_read_frames, raw_seek_frames, NULL, raw_free_buffer, raw_close_file,
+	raw_init_library, raw_exit_library };
@@ -0,0 +1,13 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef _INPUT_RAW_H_
+#define _INPUT_RAW_H_
+
+#include "input.h"
+
+/* Built-in input for headerless PCM, which needs no probing. */
+extern struct input_ops raw_ip_ops;
+
+int input_raw_parse_format(char const *spec);
+
+#endif /* _INPUT_RAW_H_ */
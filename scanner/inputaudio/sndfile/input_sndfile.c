@@ -52,6 +52,12 @@ sndfile_handle_destroy(struct input_handle **ih)
 static int
 sndfile_open_file(struct input_handle *ih, char const *filename)
 {
+	/* "-" is stdin, which must stay open after sf_close() */
+	if (!strcmp(filename, "-")) {
+		ih->file = sf_open_fd(0, SFM_READ, &ih->file_info, 0);
+		return ih->file ? 0 : 1;
+	}
+
 #ifdef G_OS_WIN32
 	int fd;
 	g_usleep(10);
@@ -149,6 +155,15 @@ sndfile_read_frames(struct input_handle *ih)
 	    (sf_count_t)ih->file_info.samplerate);
 }
 
+static int
+sndfile_seek_frames(struct input_handle *ih, size_t frame)
+{
+	if (sf_seek(ih->file, (sf_count_t)frame, SEEK_SET) < 0) {
+		return 1;
+	}
+	return 0;
+}
+
 static void
 sndfile_free_buffer(struct input_handle *ih)
 {
@@ -176,12 +191,15 @@ sndfile_exit_library(void)
 {
 }
 
-G_MODULE_EXPORT struct input_ops ip_ops = { sndfile_get_channels,
-	sndfile_get_samplerate, sndfile_get_buffer, sndfile_handle_init,
-	sndfile_handle_destroy, sndfile_open_file, sndfile_set_channel_map,
-	sndfile_allocate_buffer, sndfile_get_total_frames, sndfile_read_frames,
-	sndfile_free_buffer, sndfile_close_file, sndfile_init_library,
-	sndfile_exit_library };
+G_MODULE_EXPORT struct input_ops INPUT_PLUGIN_SYMBOL(sndfile, ip_ops) = {
+	sndfile_get_channels, sndfile_get_samplerate, sndfile_get_buffer,
+	sndfile_handle_init, sndfile_handle_destroy, sndfile_open_file,
+	sndfile_set_channel_map, sndfile_allocate_buffer,
+	sndfile_get_total_frames, sndfile_read_frames, sndfile_seek_frames,
+	NULL, sndfile_free_buffer, sndfile_close_file, sndfile_init_library,
+	sndfile_exit_library
+};
 
-G_MODULE_EXPORT char const *ip_exts[] = { "wav", "flac", "ogg", "oga", "w64",
-	NULL };
+G_MODULE_EXPORT char const *INPUT_PLUGIN_SYMBOL(sndfile, ip_exts)[] = {
+	"wav", "flac", "ogg", "oga", "w64", NULL
+};
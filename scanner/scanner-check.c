@@ -0,0 +1,151 @@
+/* See COPYING file for copyright and license details. */
+
+#include "scanner-check.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse_args.h"
+#include "scanner-common.h"
+
+extern gboolean histogram;
+extern gchar *decode_to_file;
+static gdouble target = -23.0;
+static gdouble tolerance = 1.0;
+static gdouble max_true_peak = -1.0;
+static gboolean full = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "target", 0, 0, G_OPTION_ARG_DOUBLE, &target, NULL, NULL },
+	{ "tolerance", 0, 0, G_OPTION_ARG_DOUBLE, &tolerance, NULL, NULL },
+	{ "max-tp", 0, 0, G_OPTION_ARG_DOUBLE, &max_true_peak, NULL, NULL },
+	{ "full", 0, 0, G_OPTION_ARG_NONE, &full, NULL, NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 },
+};
+
+struct check_counts {
+	guint passed;
+	guint failed;
+	guint errors;
+};
+
+/* One line per file: "VERDICT, LOUDNESS, TRUE PEAK, REASONS, NAME". The
+ * loudness of a file whose scan stopped at the true peak limit is unknown,
+ * and the time of the violation is given instead. */
+static void
+check_file(struct filename_list_node *fln, struct check_counts *counts)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+	GString *reasons = g_string_new(NULL);
+	double true_peak_db;
+	char const *verdict;
+
+	if (!fd->scanned) {
+		g_print("ERROR,          ?,          ?, not readable, ");
+		print_utf8_string(fln->fr->display);
+		putchar('\n');
+		++counts->errors;
+		g_string_free(reasons, TRUE);
+		return;
+	}
+
+	true_peak_db = fd->true_peak > 0.0 ? 20.0 * log10(fd->true_peak) :
+						   -HUGE_VAL;
+	if (fd->stopped) {
+		g_string_append_printf(reasons, "true peak at %.1f s",
+		    (double)fd->number_of_elapsed_frames /
+			(double)fd->st->samplerate);
+	} else {
+		if (!(fabs(fd->loudness - target) <= tolerance)) {
+			g_string_append(reasons, "loudness");
+		}
+		if (true_peak_db > max_true_peak) {
+			g_string_append(reasons,
+			    reasons->len ? " and true peak" : "true peak");
+		}
+	}
+	if (reasons->len) {
+		verdict = "FAIL";
+		++counts->failed;
+	} else {
+		verdict = "PASS";
+		g_string_append(reasons, "-");
+		++counts->passed;
+	}
+
+	g_print("%-5s, ", verdict);
+	if (fd->stopped) {
+		g_print("    ? LUFS");
+	} else if (fd->loudness <= -HUGE_VAL) {
+		g_print(" -inf LUFS");
+	} else {
+		g_print("%5.1f LUFS", fd->loudness);
+	}
+	if (true_peak_db <= -HUGE_VAL) {
+		g_print(",  -inf dBTP");
+	} else {
+		g_print(", %5.1f dBTP", true_peak_db);
+	}
+	g_print(", %s", reasons->str);
+	if (fln->fr->display[0]) {
+		g_print(", ");
+		print_utf8_string(fln->fr->display);
+	}
+	putchar('\n');
+	g_string_free(reasons, TRUE);
+}
+
+int
+loudness_check(GSList *files)
+{
+	struct scan_opts opts = { FALSE, "true", histogram, FALSE, NULL, 0,
+		0.0, FALSE, FALSE, FALSE, 0.0, 0.0, NULL, NULL };
+	struct check_counts counts = { 0, 0, 0 };
+	int do_scan = FALSE;
+
+	/* a file past the limit fails whatever its loudness */
+	if (!full) {
+		opts.stop_above_true_peak = pow(10.0, max_true_peak / 20.0);
+	}
+
+	g_slist_foreach(files, (GFunc)init_and_get_number_of_frames,
+	    &do_scan);
+	if (do_scan) {
+		process_files(files, &opts);
+	}
+
+	clear_line();
+	fprintf(stderr, "Check,   Loudness,  True peak, Reason\n");
+	g_slist_foreach(files, (GFunc)check_file, &counts);
+	fprintf(stderr, "%u passed, %u failed, %u not readable\n",
+	    counts.passed, counts.failed, counts.errors);
+
+	g_slist_foreach(files, (GFunc)destroy_state, NULL);
+	scanner_reset_common();
+
+	if (counts.errors) {
+		return CHECK_EXIT_ERROR;
+	}
+	return counts.failed ? CHECK_EXIT_FAIL : CHECK_EXIT_PASS;
+}
+
+gboolean
+loudness_check_parse(int *argc, char **argv[])
+{
+	if (!parse_mode_args(argc, argv, entries)) {
+		if (*argc == 1)
+			fprintf(stderr, "Missing arguments\n");
+		return FALSE;
+	}
+	if (decode_to_file) {
+		fprintf(stderr, "Cannot decode to file in check mode\n");
+		return FALSE;
+	}
+	if (tolerance < 0.0) {
+		fprintf(stderr, "Invalid tolerance\n");
+		return FALSE;
+	}
+	return TRUE;
+}
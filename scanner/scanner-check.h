@@ -0,0 +1,18 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef SCANNER_CHECK_H
+#define SCANNER_CHECK_H
+
+#include <glib.h>
+
+/* Exit codes of "loudness check". A file that can't be read counts more
+ * than a failing one; invalid options exit with EXIT_FAILURE like in the
+ * other modes. */
+#define CHECK_EXIT_PASS 0
+#define CHECK_EXIT_FAIL 2
+#define CHECK_EXIT_ERROR 3
+
+int loudness_check(GSList *files);
+gboolean loudness_check_parse(int *argc, char **argv[]);
+
+#endif /* end of include guard: SCANNER_CHECK_H */
@@ -0,0 +1,207 @@
+/* See COPYING file for copyright and license details. */
+
+#include "block_histogram.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_HISTOGRAM_VERSION "1"
+
+guint32 *
+block_histogram_new(void)
+{
+	return g_new0(guint32, BLOCK_HISTOGRAM_BINS);
+}
+
+void
+block_histogram_add(guint32 *histogram, double block_loudness)
+{
+	int bin;
+
+	if (block_loudness < -70.0) {
+		return;
+	}
+	bin = (int)((block_loudness + 70.0) * 10.0);
+	++histogram[MIN(bin, BLOCK_HISTOGRAM_BINS - 1)];
+}
+
+void
+block_histogram_remove(guint32 *histogram, double block_loudness)
+{
+	int bin;
+
+	if (block_loudness < -70.0) {
+		return;
+	}
+	bin = (int)((block_loudness + 70.0) * 10.0);
+	--histogram[MIN(bin, BLOCK_HISTOGRAM_BINS - 1)];
+}
+
+/* energy at the center of a bin */
+static double
+bin_energy(int bin)
+{
+	return pow(10.0, (-70.0 + ((double)bin + 0.5) / 10.0 + 0.691) / 10.0);
+}
+
+static double
+gated_energy(guint32 **histograms, size_t n, double threshold,
+    guint64 *nr_blocks)
+{
+	double energy = 0.0;
+	int bin;
+	size_t i;
+
+	*nr_blocks = 0;
+	for (bin = 0; bin < BLOCK_HISTOGRAM_BINS; ++bin) {
+		guint64 count = 0;
+		if (bin_energy(bin) < threshold) {
+			continue;
+		}
+		for (i = 0; i < n; ++i) {
+			count += histograms[i][bin];
+		}
+		energy += (double)count * bin_energy(bin);
+		*nr_blocks += count;
+	}
+	return energy;
+}
+
+double
+block_histogram_loudness(guint32 **histograms, size_t n)
+{
+	guint64 nr_blocks;
+	double energy;
+
+	/* absolute gate: all bins are above -70 LUFS already */
+	energy = gated_energy(histograms, n, 0.0, &nr_blocks);
+	if (!nr_blocks) {
+		return -HUGE_VAL;
+	}
+	/* relative gate: -10 LU */
+	energy = gated_energy(histograms, n,
+	    energy / (double)nr_blocks * pow(10.0, -10.0 / 10.0), &nr_blocks);
+	if (!nr_blocks) {
+		return -HUGE_VAL;
+	}
+	return 10.0 * log10(energy / (double)nr_blocks) - 0.691;
+}
+
+/* bin of the value at index (n - 1) * fraction, counting from first_bin */
+static int
+percentile_bin(guint32 const *histogram, int first_bin, guint64 n,
+    double fraction)
+{
+	guint64 index = (guint64)((double)(n - 1) * fraction + 0.5);
+	guint64 count = 0;
+	int bin;
+
+	for (bin = first_bin; bin < BLOCK_HISTOGRAM_BINS; ++bin) {
+		count += histogram[bin];
+		if (count > index) {
+			break;
+		}
+	}
+	return MIN(bin, BLOCK_HISTOGRAM_BINS - 1);
+}
+
+double
+block_histogram_range(guint32 const *histogram)
+{
+	guint32 *histograms[1];
+	guint64 nr_values;
+	double energy;
+	int first_bin;
+
+	histograms[0] = (guint32 *)histogram;
+	energy = gated_energy(histograms, 1, 0.0, &nr_values);
+	if (!nr_values) {
+		return 0.0;
+	}
+	/* relative gate: -20 LU */
+	energy = energy / (double)nr_values * pow(10.0, -20.0 / 10.0);
+	for (first_bin = 0; first_bin < BLOCK_HISTOGRAM_BINS; ++first_bin) {
+		if (bin_energy(first_bin) >= energy) {
+			break;
+		}
+	}
+	gated_energy(histograms, 1, energy, &nr_values);
+	if (!nr_values) {
+		return 0.0;
+	}
+	return (double)(percentile_bin(histogram, first_bin, nr_values, 0.95) -
+		   percentile_bin(histogram, first_bin, nr_values, 0.10)) /
+	    10.0;
+}
+
+/* "VERSION;PEAK;FIRST_BIN;COUNT,COUNT,..." with the counts running from the
+ * first to the last non-empty bin */
+gchar *
+block_histogram_to_string(guint32 const *histogram, double peak)
+{
+	GString *str = g_string_new(BLOCK_HISTOGRAM_VERSION ";");
+	char peak_str[G_ASCII_DTOSTR_BUF_SIZE];
+	int first = 0;
+	int last = BLOCK_HISTOGRAM_BINS - 1;
+	int bin;
+
+	while (first < BLOCK_HISTOGRAM_BINS && !histogram[first]) {
+		++first;
+	}
+	while (last > first && !histogram[last]) {
+		--last;
+	}
+	g_string_append(str,
+	    g_ascii_formatd(peak_str, sizeof peak_str, "%.6f", peak));
+	g_string_append_printf(str, ";%d;", first);
+	for (bin = first; bin <= last && bin < BLOCK_HISTOGRAM_BINS; ++bin) {
+		g_string_append_printf(str, bin == first ? "%u" : ",%u",
+		    histogram[bin]);
+	}
+	return g_string_free(str, FALSE);
+}
+
+guint32 *
+block_histogram_from_string(char const *str, double *peak)
+{
+	gchar **elements = g_strsplit(str, ";", 4);
+	gchar **counts = NULL;
+	guint32 *histogram = NULL;
+	gchar *endptr;
+	guint64 first;
+	int i;
+
+	if (g_strv_length(elements) != 4 ||
+	    strcmp(elements[0], BLOCK_HISTOGRAM_VERSION)) {
+		goto out;
+	}
+	*peak = g_ascii_strtod(elements[1], &endptr);
+	if (endptr == elements[1] || *endptr != '\0') {
+		goto out;
+	}
+	first = g_ascii_strtoull(elements[2], &endptr, 10);
+	if (endptr == elements[2] || *endptr != '\0' ||
+	    first > BLOCK_HISTOGRAM_BINS) {
+		goto out;
+	}
+
+	histogram = block_histogram_new();
+	counts = g_strsplit(elements[3], ",", -1);
+	for (i = 0; counts[i] && elements[3][0] != '\0'; ++i) {
+		guint64 count = g_ascii_strtoull(counts[i], &endptr, 10);
+		if (endptr == counts[i] || *endptr != '\0' ||
+		    first + (guint64)i >= BLOCK_HISTOGRAM_BINS ||
+		    count > G_MAXUINT32) {
+			g_free(histogram);
+			histogram = NULL;
+			goto out;
+		}
+		histogram[first + (guint64)i] = (guint32)count;
+	}
+
+out:
+	g_strfreev(counts);
+	g_strfreev(elements);
+	return histogram;
+}
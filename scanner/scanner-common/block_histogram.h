@@ -0,0 +1,27 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef BLOCK_HISTOGRAM_H
+#define BLOCK_HISTOGRAM_H
+
+#include <glib.h>
+
+/* Histogram of the loudness of the 400ms gating blocks of BS.1770 in 0.1 LU
+ * bins from -70 LUFS (the absolute gate) up to +30 LUFS. Gating the merged
+ * histograms of several tracks gives the loudness of the tracks scanned
+ * together, up to the bin width. */
+#define BLOCK_HISTOGRAM_BINS 1000
+
+guint32 *block_histogram_new(void);
+void block_histogram_add(guint32 *histogram, double block_loudness);
+void block_histogram_remove(guint32 *histogram, double block_loudness);
+double block_histogram_loudness(guint32 **histograms, size_t n);
+
+/* loudness range (EBU Tech 3342) of a histogram of short-term loudness
+ * values, taken in the same bins */
+double block_histogram_range(guint32 const *histogram);
+
+/* compact text form for storing a histogram and the track peak in a tag */
+gchar *block_histogram_to_string(guint32 const *histogram, double peak);
+guint32 *block_histogram_from_string(char const *str, double *peak);
+
+#endif /* end of include guard: BLOCK_HISTOGRAM_H */
@@ -0,0 +1,201 @@
+/* See COPYING file for copyright and license details. */
+
+#include "prefetch.h"
+
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+
+#include "input.h"
+
+int prefetch_lookahead = 0;
+int prefetch_budget_mb = 256;
+
+/* Files are scanned in list order, so a background thread can warm the page
+ * cache for the next prefetch_lookahead files while the current ones are
+ * decoded. Scanned files are dropped from the cache again. */
+static GMutex prefetch_mutex;
+static GCond prefetch_cond;
+static GThread *prefetch_thread;
+static gboolean prefetch_stopping;
+/* prefetched files that the scanner has not started yet */
+static int files_ahead;
+static guint64 bytes_in_flight;
+
+struct prefetch_entry {
+	guint64 length;
+	gboolean started;
+	gboolean done;
+};
+
+/* struct filename_list_node * -> struct prefetch_entry, for the files that
+ * were prefetched or started */
+static GHashTable *prefetch_entries;
+
+static void
+advise_file(char const *filename, guint64 length, gboolean will_need)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int fd = input_open_fd(filename);
+	if (fd < 0) {
+		return;
+	}
+	posix_fadvise(fd, 0, (off_t)length,
+	    will_need ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+	input_close_fd(fd);
+#else
+	/* no cache advice available, so read the file in the background */
+	static char scratch[65536];
+	int fd;
+	int ret;
+
+	if (!will_need) {
+		return;
+	}
+	fd = input_open_fd(filename);
+	if (fd < 0) {
+		return;
+	}
+	while (length > 0 &&
+	    (ret = input_read_fd(fd, scratch,
+		 (unsigned int)MIN(length, sizeof scratch))) > 0) {
+		length -= (guint64)ret;
+	}
+	input_close_fd(fd);
+#endif
+}
+
+static gpointer
+prefetch_files(gpointer arg)
+{
+	GSList *files = arg;
+	guint64 budget = (guint64)prefetch_budget_mb * 1024 * 1024;
+
+	for (; files; files = g_slist_next(files)) {
+		struct filename_list_node *fln = files->data;
+		struct prefetch_entry *entry;
+		GStatBuf stat_buf;
+		guint64 length;
+
+		if (!strcmp(fln->fr->raw, "-") ||
+		    g_stat(fln->fr->raw, &stat_buf) ||
+		    !S_ISREG(stat_buf.st_mode)) {
+			continue;
+		}
+
+		g_mutex_lock(&prefetch_mutex);
+		while (!prefetch_stopping &&
+		    (files_ahead >= prefetch_lookahead ||
+			bytes_in_flight >= budget)) {
+			g_cond_wait(&prefetch_cond, &prefetch_mutex);
+		}
+		if (prefetch_stopping) {
+			g_mutex_unlock(&prefetch_mutex);
+			break;
+		}
+		/* the scanner is already reading this one, or is done */
+		if (g_hash_table_contains(prefetch_entries, fln)) {
+			g_mutex_unlock(&prefetch_mutex);
+			continue;
+		}
+		length = MIN((guint64)stat_buf.st_size,
+		    budget - bytes_in_flight);
+		entry = g_new0(struct prefetch_entry, 1);
+		entry->length = length;
+		bytes_in_flight += length;
+		++files_ahead;
+		g_hash_table_insert(prefetch_entries, fln, entry);
+		g_mutex_unlock(&prefetch_mutex);
+
+		advise_file(fln->fr->raw, length, TRUE);
+	}
+	return NULL;
+}
+
+void
+prefetch_start(GSList *files)
+{
+	if (prefetch_lookahead <= 0) {
+		return;
+	}
+	prefetch_stopping = FALSE;
+	files_ahead = 0;
+	bytes_in_flight = 0;
+	prefetch_entries = g_hash_table_new_full(g_direct_hash,
+	    g_direct_equal, NULL, g_free);
+	prefetch_thread = g_thread_new(NULL, prefetch_files, files);
+}
+
+void
+prefetch_file_started(struct filename_list_node *fln)
+{
+	struct prefetch_entry *entry;
+
+	if (!prefetch_thread) {
+		return;
+	}
+	g_mutex_lock(&prefetch_mutex);
+	entry = g_hash_table_lookup(prefetch_entries, fln);
+	if (!entry) {
+		entry = g_new0(struct prefetch_entry, 1);
+		g_hash_table_insert(prefetch_entries, fln, entry);
+	} else if (!entry->started) {
+		--files_ahead;
+	}
+	entry->started = TRUE;
+	g_cond_broadcast(&prefetch_cond);
+	g_mutex_unlock(&prefetch_mutex);
+}
+
+void
+prefetch_file_done(struct filename_list_node *fln)
+{
+	struct prefetch_entry *entry;
+
+	if (!prefetch_thread || !strcmp(fln->fr->raw, "-")) {
+		return;
+	}
+	g_mutex_lock(&prefetch_mutex);
+	entry = g_hash_table_lookup(prefetch_entries, fln);
+	if (entry) {
+		bytes_in_flight -= entry->length;
+		entry->length = 0;
+		entry->done = TRUE;
+		g_cond_broadcast(&prefetch_cond);
+	}
+	g_mutex_unlock(&prefetch_mutex);
+
+	advise_file(fln->fr->raw, 0, FALSE);
+}
+
+/* files that were prefetched but never scanned, like after an error */
+static void
+release_unscanned_file(struct filename_list_node *fln,
+    struct prefetch_entry *entry, gpointer unused)
+{
+	(void)unused;
+	if (!entry->done && entry->length) {
+		advise_file(fln->fr->raw, 0, FALSE);
+	}
+}
+
+void
+prefetch_stop(void)
+{
+	if (!prefetch_thread) {
+		return;
+	}
+	g_mutex_lock(&prefetch_mutex);
+	prefetch_stopping = TRUE;
+	g_cond_broadcast(&prefetch_cond);
+	g_mutex_unlock(&prefetch_mutex);
+
+	g_thread_join(prefetch_thread);
+	prefetch_thread = NULL;
+	g_hash_table_foreach(prefetch_entries, (GHFunc)release_unscanned_file,
+	    NULL);
+	g_hash_table_destroy(prefetch_entries);
+	prefetch_entries = NULL;
+	bytes_in_flight = 0;
+	files_ahead = 0;
+}
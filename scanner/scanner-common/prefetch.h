@@ -0,0 +1,20 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <glib.h>
+
+#include "filetree.h"
+
+/* number of files to warm up ahead of the scanner, 0 disables prefetching */
+extern int prefetch_lookahead;
+/* maximum size of prefetched but not yet scanned data in MiB */
+extern int prefetch_budget_mb;
+
+void prefetch_start(GSList *files);
+void prefetch_file_started(struct filename_list_node *fln);
+void prefetch_file_done(struct filename_list_node *fln);
+void prefetch_stop(void);
+
+#endif /* end of include guard: PREFETCH_H */
@@ -1,9 +1,12 @@
 /* See COPYING file for copyright and license details. */
 
+#include "block_histogram.h"
 #include "nproc.h"
+#include "prefetch.h"
 #include "scanner-common.h"
 
 #include <glib/gstdio.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -22,11 +25,18 @@ GCond progress_cond;
 guint64 elapsed_frames = 0;
 guint64 total_frames = 0;
 
+/* Streams (stdin) have no known length. While one is open, the progress bar
+ * shows the seconds processed instead of a percentage. */
+static int pending_streams = 0;
+static unsigned long stream_samplerate = 0;
+
 void
 scanner_init_common(void)
 {
 	total_frames = 0;
 	elapsed_frames = 0;
+	pending_streams = 0;
+	stream_samplerate = 0;
 }
 
 void
@@ -34,6 +44,8 @@ scanner_reset_common(void)
 {
 	g_mutex_lock(&progress_mutex);
 	total_frames = elapsed_frames = 0;
+	pending_streams = 0;
+	stream_samplerate = 0;
 	g_cond_broadcast(&progress_cond);
 	g_mutex_unlock(&progress_mutex);
 }
@@ -42,8 +54,6 @@ int
 open_plugin(char const *raw, char const *display, struct input_ops **ops,
     struct input_handle **ih)
 {
-	int result;
-
 	*ops = input_get_ops(raw);
 	if (!(*ops)) {
 		if (verbose) {
@@ -52,16 +62,21 @@ open_plugin(char const *raw, char const *display, struct input_ops **ops,
 		}
 		return 1;
 	}
-	*ih = (*ops)->handle_init();
-
-	result = (*ops)->open_file(*ih, raw);
-	if (result) {
-		if (verbose) {
-			fprintf(stderr, "Error opening file '%s'\n", display);
+	/* Plugins that take the file as well get their turn if one fails. A
+	 * plugin that fails on stdin after reading from it leaves less to the
+	 * next one, which then usually fails too. */
+	for (; *ops; *ops = input_get_next_ops(raw, *ops)) {
+		*ih = (*ops)->handle_init();
+		if (!(*ops)->open_file(*ih, raw)) {
+			return 0;
 		}
-		return 1;
+		(*ops)->handle_destroy(ih);
+		*ih = NULL;
 	}
-	return 0;
+	if (verbose) {
+		fprintf(stderr, "Error opening file '%s'\n", display);
+	}
+	return 1;
 }
 
 void
@@ -73,10 +88,23 @@ init_and_get_number_of_frames(struct filename_list_node *fln, int *do_scan)
 	struct input_handle *ih = NULL;
 	int result;
 
-	fln->d = g_malloc(sizeof(struct file_data));
-	memcpy(fln->d, &empty, sizeof empty);
+	/* tag mode may have set up the file data to cache its album key */
+	if (!fln->d) {
+		fln->d = g_malloc(sizeof(struct file_data));
+		memcpy(fln->d, &empty, sizeof empty);
+	}
 	fd = (struct file_data *)fln->d;
 
+	/* a stream can only be read once, so skip the duration pre-pass */
+	if (!strcmp(fln->fr->raw, "-")) {
+		*do_scan = TRUE;
+		g_mutex_lock(&progress_mutex);
+		++pending_streams;
+		g_cond_broadcast(&progress_cond);
+		g_mutex_unlock(&progress_mutex);
+		return;
+	}
+
 	result = open_plugin(fln->fr->raw, fln->fr->display, &ops, &ih);
 	if (result) {
 		goto free;
@@ -98,6 +126,371 @@ free:
 	}
 }
 
+static void
+set_channels(ebur128_state *st, int const *channel_map, int force_dual_mono)
+{
+	unsigned int i;
+
+	if (channel_map) {
+		for (i = 0; i < st->channels; ++i) {
+			ebur128_set_channel(st, i, channel_map[i]);
+		}
+	}
+	if (st->channels == 1 && force_dual_mono) {
+		ebur128_set_channel(st, 0, EBUR128_DUAL_MONO);
+	}
+}
+
+static void
+get_peaks(ebur128_state *st, double *peak, double *true_peak)
+{
+	unsigned int i;
+
+	if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+		for (i = 0; i < st->channels; ++i) {
+			double sp;
+			ebur128_sample_peak(st, i, &sp);
+			if (sp > *peak) {
+				*peak = sp;
+			}
+		}
+	}
+	if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+		for (i = 0; i < st->channels; ++i) {
+			double tp;
+			ebur128_true_peak(st, i, &tp);
+			if (tp > *true_peak) {
+				*true_peak = tp;
+			}
+		}
+	}
+}
+
+/* Analyse opts->estimate_windows evenly spaced windows instead of the whole
+ * file. Each window is measured with its own state in fd->window_states, so
+ * that neither the filters nor the gating blocks reach across a seek.
+ * Returns non-zero if nothing has been read and the file must be scanned
+ * fully instead (because it is too short or not seekable). */
+static int
+scan_estimate_windows(struct file_data *fd, struct input_ops *ops,
+    struct input_handle *ih, float *buffer, int const *channel_map,
+    struct scan_opts *opts)
+{
+	size_t nr_windows = (size_t)opts->estimate_windows;
+	size_t window_frames = (size_t)(opts->estimate_window_length *
+	    (double)fd->st->samplerate + 0.5);
+	size_t file_frames = fd->number_of_frames;
+	double segment_frames;
+	double *energies;
+	size_t windows_read;
+	size_t i;
+
+	if (!ops->seek_frames || !window_frames ||
+	    nr_windows * window_frames >= file_frames) {
+		return 1;
+	}
+
+	/* each window sits in the middle of one of nr_windows equal segments */
+	segment_frames = (double)file_frames / (double)nr_windows;
+	if (ops->seek_frames(ih,
+		(size_t)((segment_frames - (double)window_frames) / 2.0))) {
+		return 1;
+	}
+
+	/* only the windows count towards the progress bar */
+	g_mutex_lock(&progress_mutex);
+	total_frames -= file_frames - nr_windows * window_frames;
+	g_cond_broadcast(&progress_cond);
+	g_mutex_unlock(&progress_mutex);
+	fd->number_of_frames = nr_windows * window_frames;
+
+	fd->window_states = g_new0(ebur128_state *, nr_windows);
+	energies = g_new(double, nr_windows);
+	for (windows_read = 0; windows_read < nr_windows; ++windows_read) {
+		size_t frames_left = window_frames;
+		size_t nr_frames_read;
+		ebur128_state *st;
+		double loudness;
+
+		if (windows_read > 0 &&
+		    ops->seek_frames(ih,
+			(size_t)(segment_frames * (double)windows_read +
+			    (segment_frames - (double)window_frames) / 2.0))) {
+			break;
+		}
+		st = ebur128_init(fd->st->channels, fd->st->samplerate,
+		    fd->st->mode);
+		if (!st) {
+			abort();
+		}
+		set_channels(st, channel_map, opts->force_dual_mono);
+		fd->window_states[fd->nr_window_states++] = st;
+		while (frames_left && (nr_frames_read = ops->read_frames(ih))) {
+			nr_frames_read = MIN(nr_frames_read, frames_left);
+			g_mutex_lock(&progress_mutex);
+			elapsed_frames += nr_frames_read;
+			g_cond_broadcast(&progress_cond);
+			g_mutex_unlock(&progress_mutex);
+			fd->number_of_elapsed_frames += nr_frames_read;
+			if (ebur128_add_frames_float(st, buffer,
+				nr_frames_read)) {
+				abort();
+			}
+			frames_left -= nr_frames_read;
+		}
+		if (frames_left) {
+			break;
+		}
+		/* gated like the estimate the bound is for */
+		ebur128_loudness_global(st, &loudness);
+		energies[windows_read] = loudness <= -HUGE_VAL ?
+			  0.0 :
+			  pow(10.0, loudness / 10.0);
+	}
+
+	/* Standard error of the mean gated window energy (with finite
+	 * population correction), converted to a 95% bound in LU. */
+	fd->loudness_error = HUGE_VAL;
+	if (windows_read > 1) {
+		double mean = 0.0;
+		double variance = 0.0;
+		double sampled = (double)(windows_read * window_frames) /
+		    (double)file_frames;
+		double standard_error;
+
+		for (i = 0; i < windows_read; ++i) {
+			mean += energies[i];
+		}
+		mean /= (double)windows_read;
+		for (i = 0; i < windows_read; ++i) {
+			variance += (energies[i] - mean) * (energies[i] - mean);
+		}
+		variance /= (double)(windows_read - 1);
+		standard_error = sqrt(variance / (double)windows_read *
+		    (1.0 - sampled));
+		fd->loudness_error = mean > 0.0 ?
+			  10.0 * log10(1.0 + 1.96 * standard_error / mean) :
+			  0.0;
+	}
+	g_free(energies);
+
+	return 0;
+}
+
+/* Merges the windows of estimate mode into the results of the file. */
+static void
+get_window_results(struct file_data *fd, int lra)
+{
+	size_t i;
+
+	ebur128_loudness_global_multiple(fd->window_states,
+	    fd->nr_window_states, &fd->loudness);
+	if (lra &&
+	    ebur128_loudness_range_multiple(fd->window_states,
+		fd->nr_window_states, &fd->lra)) {
+		abort();
+	}
+	for (i = 0; i < fd->nr_window_states; ++i) {
+		get_peaks(fd->window_states[i], &fd->peak, &fd->true_peak);
+	}
+}
+
+/* Position in the stream of 100ms steps that make up the gating blocks. */
+struct block_position {
+	size_t frames_in_step;
+	size_t steps;
+};
+
+/* Add frames in 100ms steps like libebur128 does when it computes its gating
+ * blocks, so that the momentary loudness after each step is the loudness of
+ * one block. */
+static int
+add_frames_collecting_blocks(struct file_data *fd, float *buffer,
+    size_t frames, struct block_position *pos)
+{
+	size_t step_frames = (fd->st->samplerate + 5) / 10;
+
+	while (frames) {
+		size_t n = MIN(frames, step_frames - pos->frames_in_step);
+		if (ebur128_add_frames_float(fd->st, buffer, n)) {
+			return 1;
+		}
+		buffer += n * fd->st->channels;
+		frames -= n;
+		pos->frames_in_step += n;
+		if (pos->frames_in_step == step_frames) {
+			pos->frames_in_step = 0;
+			/* the first block is complete after four steps */
+			if (++pos->steps >= 4) {
+				double loudness;
+				ebur128_loudness_momentary(fd->st, &loudness);
+				block_histogram_add(fd->block_histogram,
+				    loudness);
+			}
+		}
+	}
+	return 0;
+}
+
+/* The segment being measured. Only one segment state exists at a time, next
+ * to the state of the whole file. */
+struct segment_scan {
+	ebur128_state *st;
+	size_t current;
+	size_t position;
+	int const *channel_map;
+	int force_dual_mono;
+};
+
+static void
+finish_segment(struct file_data *fd, struct segment_scan *scan)
+{
+	struct segment_data *segment = &fd->segments[scan->current];
+
+	segment->number_of_frames = scan->position - segment->start;
+	ebur128_loudness_global(scan->st, &segment->loudness);
+	if ((scan->st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA &&
+	    ebur128_loudness_range(scan->st, &segment->lra)) {
+		abort();
+	}
+	get_peaks(scan->st, &segment->peak, &segment->true_peak);
+	ebur128_destroy(&scan->st);
+}
+
+static void
+add_frames_to_segments(struct file_data *fd, struct segment_scan *scan,
+    float *buffer, size_t frames)
+{
+	while (frames) {
+		size_t next = scan->st ? scan->current + 1 : scan->current;
+		size_t n = frames;
+
+		if (next < fd->nr_segments) {
+			size_t start = fd->segments[next].start;
+			if (scan->position >= start) {
+				if (scan->st) {
+					finish_segment(fd, scan);
+				}
+				scan->current = next;
+				scan->st = ebur128_init(fd->st->channels,
+				    fd->st->samplerate, fd->st->mode);
+				set_channels(scan->st, scan->channel_map,
+				    scan->force_dual_mono);
+				continue;
+			}
+			n = MIN(n, start - scan->position);
+		}
+		if (scan->st &&
+		    ebur128_add_frames_float(scan->st, buffer, n)) {
+			abort();
+		}
+		buffer += n * fd->st->channels;
+		frames -= n;
+		scan->position += n;
+	}
+}
+
+static gboolean
+true_peak_above(ebur128_state *st, double limit)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->channels; ++i) {
+		double tp = 0.0;
+		/* fails without EBUR128_MODE_TRUE_PEAK, which is never above */
+		if (!ebur128_true_peak(st, i, &tp) && tp > limit) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Silence is found in 100ms blocks: a block is silent if the mean square of
+ * each channel is below the threshold. */
+struct silence_detector {
+	double threshold;
+	double *energies;
+	size_t block_frames;
+	size_t frames_in_block;
+	size_t position;
+	/* start of the current run of silent blocks, NO_SILENCE if none */
+	size_t run_start;
+	gboolean heard_sound;
+};
+
+#define NO_SILENCE ((size_t)-1)
+
+static void
+end_silence_block(struct file_data *fd, struct silence_detector *sd)
+{
+	size_t block_start = sd->position - sd->frames_in_block;
+	gboolean silent = TRUE;
+	unsigned int c;
+
+	for (c = 0; c < fd->st->channels; ++c) {
+		if (sd->energies[c] / (double)sd->frames_in_block >=
+		    sd->threshold) {
+			silent = FALSE;
+		}
+		sd->energies[c] = 0.0;
+	}
+	sd->frames_in_block = 0;
+
+	if (silent) {
+		if (sd->run_start == NO_SILENCE) {
+			sd->run_start = block_start;
+		}
+		return;
+	}
+	if (sd->run_start != NO_SILENCE) {
+		if (!sd->heard_sound) {
+			fd->leading_silence = block_start;
+		} else if (block_start - sd->run_start > fd->longest_gap) {
+			fd->longest_gap = block_start - sd->run_start;
+			fd->longest_gap_start = sd->run_start;
+		}
+		sd->run_start = NO_SILENCE;
+	}
+	sd->heard_sound = TRUE;
+}
+
+static void
+add_frames_to_silence_detector(struct file_data *fd,
+    struct silence_detector *sd, float const *buffer, size_t frames)
+{
+	unsigned int channels = fd->st->channels;
+	size_t i;
+	unsigned int c;
+
+	for (i = 0; i < frames; ++i) {
+		for (c = 0; c < channels; ++c) {
+			double sample = (double)buffer[i * channels + c];
+			sd->energies[c] += sample * sample;
+		}
+		++sd->position;
+		if (++sd->frames_in_block == sd->block_frames) {
+			end_silence_block(fd, sd);
+		}
+	}
+}
+
+static void
+finish_silence_detector(struct file_data *fd, struct silence_detector *sd)
+{
+	if (sd->frames_in_block) {
+		end_silence_block(fd, sd);
+	}
+	if (sd->run_start != NO_SILENCE) {
+		if (sd->heard_sound) {
+			fd->trailing_silence = sd->position - sd->run_start;
+		} else {
+			fd->leading_silence = sd->position;
+			fd->trailing_silence = sd->position;
+		}
+	}
+	g_free(sd->energies);
+}
+
 void
 init_state_and_scan_work_item(struct filename_list_node *fln,
     struct scan_opts *opts)
@@ -107,17 +500,24 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 	struct input_ops *ops = NULL;
 	struct input_handle *ih = NULL;
 	int r128_mode = EBUR128_MODE_I;
-	unsigned int i;
 	int *channel_map;
 
 	int result;
 	float *buffer = NULL;
 	size_t nr_frames_read;
+	int estimated = FALSE;
+	int is_stream = !strcmp(fln->fr->raw, "-");
+	struct block_position block_pos = { 0, 0 };
+	struct segment_scan segment_scan = { NULL, 0, 0, NULL, FALSE };
+	struct silence_detector silence = { 0.0, NULL, 0, 0, 0, NO_SILENCE,
+		FALSE };
 
 #ifdef USE_SNDFILE
 	SNDFILE *outfile = NULL;
 #endif
 
+	prefetch_file_started(fln);
+
 	result = open_plugin(fln->fr->raw, fln->fr->display, &ops, &ih);
 	if (result) {
 		g_mutex_lock(&progress_mutex);
@@ -148,16 +548,29 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 	fd->st = ebur128_init(ops->get_channels(ih), ops->get_samplerate(ih),
 	    r128_mode);
 
+	if (is_stream) {
+		g_mutex_lock(&progress_mutex);
+		stream_samplerate = fd->st->samplerate;
+		g_mutex_unlock(&progress_mutex);
+	}
+
 	channel_map = g_malloc(fd->st->channels * sizeof(int));
-	if (!ops->set_channel_map(ih, channel_map)) {
-		for (i = 0; i < fd->st->channels; ++i) {
-			ebur128_set_channel(fd->st, i, channel_map[i]);
-		}
+	if (ops->set_channel_map(ih, channel_map)) {
+		g_free(channel_map);
+		channel_map = NULL;
 	}
-	free(channel_map);
+	set_channels(fd->st, channel_map, opts->force_dual_mono);
 
-	if (fd->st->channels == 1 && opts->force_dual_mono) {
-		ebur128_set_channel(fd->st, 0, EBUR128_DUAL_MONO);
+	if (opts->segments) {
+		fd->segments = segments_get(ops, ih, fln->fr->raw,
+		    fd->st->samplerate, &fd->nr_segments);
+		segment_scan.channel_map = channel_map;
+		segment_scan.force_dual_mono = opts->force_dual_mono;
+	}
+	if (opts->silence) {
+		silence.threshold = pow(10.0, opts->silence_threshold / 10.0);
+		silence.energies = g_new0(double, fd->st->channels);
+		silence.block_frames = (fd->st->samplerate + 5) / 10;
 	}
 
 	result = ops->allocate_buffer(ih);
@@ -181,14 +594,34 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 	}
 #endif
 
-	while ((nr_frames_read = ops->read_frames(ih))) {
+	if (opts->block_histogram) {
+		fd->block_histogram = block_histogram_new();
+	} else if (opts->estimate_windows > 0) {
+		estimated = !scan_estimate_windows(fd, ops, ih, buffer,
+		    channel_map, opts);
+	}
+
+	while (!estimated && (nr_frames_read = ops->read_frames(ih))) {
 		g_mutex_lock(&progress_mutex);
 		elapsed_frames += nr_frames_read;
 		g_cond_broadcast(&progress_cond);
 		g_mutex_unlock(&progress_mutex);
 		fd->number_of_elapsed_frames += nr_frames_read;
-		result = ebur128_add_frames_float(fd->st, buffer,
-		    nr_frames_read);
+		if (fd->block_histogram) {
+			result = add_frames_collecting_blocks(fd, buffer,
+			    nr_frames_read, &block_pos);
+		} else {
+			result = ebur128_add_frames_float(fd->st, buffer,
+			    nr_frames_read);
+		}
+		if (fd->segments) {
+			add_frames_to_segments(fd, &segment_scan, buffer,
+			    nr_frames_read);
+		}
+		if (silence.energies) {
+			add_frames_to_silence_detector(fd, &silence, buffer,
+			    nr_frames_read);
+		}
 #ifdef USE_SNDFILE
 		if (opts->decode_file) {
 			if (sf_writef_float(outfile, buffer,
@@ -201,6 +634,12 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 		if (result) {
 			abort();
 		}
+		/* only a verdict is needed, which can't change any more */
+		if (opts->stop_above_true_peak > 0.0 &&
+		    true_peak_above(fd->st, opts->stop_above_true_peak)) {
+			fd->stopped = TRUE;
+			break;
+		}
 	}
 
 #ifdef USE_SNDFILE
@@ -210,7 +649,7 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 #endif
 
 	if (fd->number_of_elapsed_frames != fd->number_of_frames) {
-		if (verbose) {
+		if (verbose && !is_stream && !fd->stopped) {
 			fprintf(stderr,
 			    "Warning: Could not read full file"
 			    " or determine right length for file %s: "
@@ -224,38 +663,30 @@ init_state_and_scan_work_item(struct filename_list_node *fln,
 		g_cond_broadcast(&progress_cond);
 		g_mutex_unlock(&progress_mutex);
 	}
-	ebur128_loudness_global(fd->st, &fd->loudness);
-	if (opts->lra) {
-		result = ebur128_loudness_range(fd->st, &fd->lra);
-		if (result) {
-			abort();
-		}
-	}
-
-	if ((fd->st->mode & EBUR128_MODE_SAMPLE_PEAK) ==
-	    EBUR128_MODE_SAMPLE_PEAK) {
-		for (i = 0; i < fd->st->channels; ++i) {
-			double sp;
-			ebur128_sample_peak(fd->st, i, &sp);
-			if (sp > fd->peak) {
-				fd->peak = sp;
+	if (fd->window_states) {
+		get_window_results(fd, opts->lra);
+	} else {
+		ebur128_loudness_global(fd->st, &fd->loudness);
+		if (opts->lra) {
+			result = ebur128_loudness_range(fd->st, &fd->lra);
+			if (result) {
+				abort();
 			}
 		}
+		get_peaks(fd->st, &fd->peak, &fd->true_peak);
 	}
-	if ((fd->st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
-		for (i = 0; i < fd->st->channels; ++i) {
-			double tp;
-			ebur128_true_peak(fd->st, i, &tp);
-			if (tp > fd->true_peak) {
-				fd->true_peak = tp;
-			}
-		}
+	if (segment_scan.st) {
+		finish_segment(fd, &segment_scan);
+	}
+	if (silence.energies) {
+		finish_silence_detector(fd, &silence);
 	}
 	fd->scanned = TRUE;
 
 	if (ih) {
 		ops->free_buffer(ih);
 	}
+	g_free(channel_map);
 free:
 	if (!result) {
 		ops->close_file(ih);
@@ -263,6 +694,16 @@ free:
 	if (ih) {
 		ops->handle_destroy(&ih);
 	}
+	prefetch_file_done(fln);
+	if (is_stream) {
+		g_mutex_lock(&progress_mutex);
+		--pending_streams;
+		g_cond_broadcast(&progress_cond);
+		g_mutex_unlock(&progress_mutex);
+	}
+	if (opts->file_done) {
+		opts->file_done(fln, opts->file_done_data);
+	}
 }
 
 void
@@ -275,23 +716,50 @@ void
 destroy_state(struct filename_list_node *fln, gpointer unused)
 {
 	struct file_data *fd = (struct file_data *)fln->d;
+	size_t i;
 
 	(void)unused;
 	if (fd->st) {
 		ebur128_destroy(&fd->st);
 	}
+	for (i = 0; i < fd->nr_window_states; ++i) {
+		ebur128_destroy(&fd->window_states[i]);
+	}
+	g_free(fd->window_states);
+	fd->window_states = NULL;
+	fd->nr_window_states = 0;
+	g_free(fd->block_histogram);
+	fd->block_histogram = NULL;
+	segments_free(fd->segments, fd->nr_segments);
+	fd->segments = NULL;
+	fd->nr_segments = 0;
 }
 
 void
 get_state(struct filename_list_node *fln, GPtrArray *states)
 {
 	struct file_data *fd = (struct file_data *)fln->d;
+	size_t i;
 
-	if (fd->scanned) {
+	if (fd->scanned && fd->window_states) {
+		for (i = 0; i < fd->nr_window_states; ++i) {
+			g_ptr_array_add(states, fd->window_states[i]);
+		}
+	} else if (fd->scanned && fd->st) {
 		g_ptr_array_add(states, fd->st);
 	}
 }
 
+void
+get_block_histogram(struct filename_list_node *fln, GPtrArray *histograms)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	if (fd->scanned && fd->block_histogram) {
+		g_ptr_array_add(histograms, fd->block_histogram);
+	}
+}
+
 void
 get_max_peaks(struct filename_list_node *fln, struct file_data *result)
 {
@@ -326,20 +794,30 @@ print_progress_bar(gpointer arg)
 			g_cond_broadcast(&progress_cond);
 		}
 
-		if (total_frames != elapsed_frames) {
+		if (total_frames != elapsed_frames || pending_streams) {
 			g_cond_wait(&progress_cond, &progress_mutex);
 		}
 
 		/* refresh progress bar at max 10 times per second */
 		gint64 current_time = g_get_monotonic_time();
 		if (last_time == -1 || current_time >= last_time + 100 * 1000 ||
-		    total_frames == elapsed_frames) {
+		    (total_frames == elapsed_frames && !pending_streams)) {
 			last_time = current_time;
 		} else {
 			g_mutex_unlock(&progress_mutex);
 			continue;
 		}
 
+		if (pending_streams) {
+			if (stream_samplerate) {
+				fprintf(stderr, "%10.1f s processed\r",
+				    (double)elapsed_frames /
+					(double)stream_samplerate);
+			}
+			g_mutex_unlock(&progress_mutex);
+			continue;
+		}
+
 		if (total_frames) {
 			bars = (int)(elapsed_frames * G_GUINT64_CONSTANT(72) /
 			    total_frames);
@@ -397,10 +875,12 @@ process_files(GSList *files, struct scan_opts *opts)
 	}
 	g_mutex_unlock(&progress_mutex);
 
+	prefetch_start(files);
 	pool = g_thread_pool_new((GFunc)init_state_and_scan_work_item, opts,
 	    nproc(), FALSE, NULL);
 	g_slist_foreach(files, (GFunc)init_state_and_scan, pool);
 	g_thread_pool_free(pool, FALSE, TRUE);
+	prefetch_stop();
 	g_thread_join(progress_bar_thread);
 }
 
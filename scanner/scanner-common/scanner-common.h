@@ -6,6 +6,7 @@
 #include "ebur128.h"
 #include "filetree.h"
 #include "input.h"
+#include "segments.h"
 
 #include <glib.h>
 
@@ -15,9 +16,15 @@
 
 struct file_data {
 	ebur128_state *st;
+	/* in estimate mode, each window is measured with its own state and
+	 * 'st' gets no audio */
+	ebur128_state **window_states;
+	size_t nr_window_states;
 	size_t number_of_frames;
 	size_t number_of_elapsed_frames;
 	double loudness;
+	/* 95% confidence bound of 'loudness' in LU, only set in estimate mode */
+	double loudness_error;
 	double lra;
 	double peak;
 	double true_peak;
@@ -25,6 +32,33 @@ struct file_data {
 	double gain_album;
 	double peak_album;
 
+	/* length in seconds of results read from tags, which have no state */
+	double length;
+
+	/* loudness of the gating blocks, see block_histogram.h; only
+	 * collected if scan_opts.block_histogram is set */
+	guint32 *block_histogram;
+
+	/* chapters or cue sheet tracks, only measured if scan_opts.segments
+	 * is set */
+	struct segment_data *segments;
+	size_t nr_segments;
+
+	/* silence in frames, in 100ms blocks whose loudest channel is below
+	 * scan_opts.silence_threshold; only measured if scan_opts.silence is
+	 * set. A silent file has leading and trailing silence of its length. */
+	size_t leading_silence;
+	size_t trailing_silence;
+	size_t longest_gap;
+	size_t longest_gap_start;
+
+	/* set if the scan stopped at scan_opts.stop_above_true_peak */
+	gboolean stopped;
+
+	/* files sharing this key form an album in tag mode, read once per
+	 * file as it may come from the tags */
+	gchar *album_key;
+
 	void *user;
 
 	gboolean scanned;
@@ -40,6 +74,24 @@ struct scan_opts {
 	gboolean force_dual_mono;
 	/* if non-zero, decode all input audio to this file */
 	gchar *decode_file;
+	/* if non-zero, only analyse this many evenly spaced windows per file */
+	int estimate_windows;
+	/* length of each estimate window in seconds */
+	double estimate_window_length;
+	/* collect a block_histogram for each file */
+	gboolean block_histogram;
+	/* measure the segments of each file as well, see segments.h */
+	gboolean segments;
+	/* find leading, trailing and internal silence below this many dBFS */
+	gboolean silence;
+	double silence_threshold;
+	/* if non-zero, stop reading a file once its true peak is above this
+	 * linear level, see file_data.stopped */
+	double stop_above_true_peak;
+	/* if set, called from the worker thread with the filename_list_node
+	 * of each file that is done */
+	GFunc file_done;
+	gpointer file_done_data;
 };
 
 extern GMutex progress_mutex;
@@ -58,6 +110,7 @@ void init_state_and_scan_work_item(struct filename_list_node *fln,
 void init_state_and_scan(gpointer work_item, GThreadPool *pool);
 void destroy_state(struct filename_list_node *fln, gpointer unused);
 void get_state(struct filename_list_node *fln, GPtrArray *states);
+void get_block_histogram(struct filename_list_node *fln, GPtrArray *histograms);
 void get_max_peaks(struct filename_list_node *fln, struct file_data *result);
 void clear_line(void);
 void process_files(GSList *files, struct scan_opts *opts);
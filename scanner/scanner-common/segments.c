@@ -0,0 +1,253 @@
+/* See COPYING file for copyright and license details. */
+
+#include "segments.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* cue sheet times are minutes, seconds and frames of 1/75 seconds */
+#define CUE_FRAMES_PER_SECOND 75
+
+struct cue_track {
+	gchar *title;
+	guint64 start;
+	/* FILE entry that holds INDEX 01 of the track, -1 if there is none */
+	int file;
+};
+
+static void
+add_segment(GArray *segments, size_t start, gchar *title)
+{
+	struct segment_data segment;
+
+	memset(&segment, '\0', sizeof segment);
+	segment.title = title;
+	segment.start = start;
+	segment.loudness = -HUGE_VAL;
+	g_array_append_val(segments, segment);
+}
+
+static gint
+compare_segments(gconstpointer a, gconstpointer b)
+{
+	size_t start_a = ((struct segment_data const *)a)->start;
+	size_t start_b = ((struct segment_data const *)b)->start;
+
+	return start_a < start_b ? -1 : start_a > start_b;
+}
+
+/* Returns the next, possibly quoted, word of a cue sheet line and moves
+ * *line past it. */
+static gchar *
+next_cue_token(char **line)
+{
+	char *p = *line;
+	char *start;
+	gchar *ret;
+
+	while (*p == ' ' || *p == '\t') {
+		++p;
+	}
+	if (!*p) {
+		*line = p;
+		return NULL;
+	}
+	if (*p == '"') {
+		start = ++p;
+		while (*p && *p != '"') {
+			++p;
+		}
+	} else {
+		start = p;
+		while (*p && *p != ' ' && *p != '\t') {
+			++p;
+		}
+	}
+	ret = g_strndup(start, (gsize)(p - start));
+	*line = *p ? p + 1 : p;
+	return ret;
+}
+
+/* Adds the tracks of the cue sheet that belong to 'filename'. A sheet with a
+ * single FILE entry is taken to describe the file whatever its name. */
+static gboolean
+read_cue_sheet(char const *cue_filename, char const *filename,
+    unsigned long samplerate, GArray *segments)
+{
+	gchar *contents;
+	gsize length;
+	gchar *text;
+	gchar *utf8 = NULL;
+	gchar **lines;
+	gchar *basename;
+	GArray *tracks;
+	struct cue_track *track = NULL;
+	int nr_files = 0;
+	int matching_file = -1;
+	int wanted_file;
+	guint i;
+
+	if (!g_file_get_contents(cue_filename, &contents, &length, NULL)) {
+		return FALSE;
+	}
+	text = contents;
+	if (length >= 3 && !memcmp(text, "\xef\xbb\xbf", 3)) {
+		text += 3;
+	} else if (!g_utf8_validate(text, -1, NULL)) {
+		/* sheets written by older rippers are mostly Windows-1252 */
+		utf8 = g_convert(text, -1, "UTF-8", "WINDOWS-1252", NULL, NULL,
+		    NULL);
+		if (!utf8) {
+			g_free(contents);
+			return FALSE;
+		}
+		text = utf8;
+	}
+
+	basename = g_path_get_basename(filename);
+	tracks = g_array_new(FALSE, FALSE, sizeof(struct cue_track));
+	lines = g_strsplit(text, "\n", -1);
+	for (i = 0; lines[i]; ++i) {
+		char *line = g_strchomp(lines[i]);
+		gchar *keyword = next_cue_token(&line);
+
+		if (!keyword) {
+			continue;
+		}
+		if (!g_ascii_strcasecmp(keyword, "FILE")) {
+			gchar *name = next_cue_token(&line);
+			gchar *name_basename;
+
+			if (name) {
+				name_basename = g_path_get_basename(name);
+				if (matching_file < 0 &&
+				    !strcmp(name_basename, basename)) {
+					matching_file = nr_files;
+				}
+				g_free(name_basename);
+				g_free(name);
+			}
+			++nr_files;
+		} else if (!g_ascii_strcasecmp(keyword, "TRACK")) {
+			struct cue_track new_track = { NULL, 0, -1 };
+
+			g_array_append_val(tracks, new_track);
+			track = &g_array_index(tracks, struct cue_track,
+			    tracks->len - 1);
+		} else if (!g_ascii_strcasecmp(keyword, "TITLE") && track) {
+			g_free(track->title);
+			track->title = next_cue_token(&line);
+		} else if (!g_ascii_strcasecmp(keyword, "INDEX") && track) {
+			gchar *number = next_cue_token(&line);
+			gchar *time = next_cue_token(&line);
+			unsigned minutes, seconds, frames;
+
+			if (number && time && atoi(number) == 1 &&
+			    sscanf(time, "%u:%u:%u", &minutes, &seconds,
+				&frames) == 3) {
+				track->start = ((guint64)minutes * 60 +
+						   seconds) *
+					CUE_FRAMES_PER_SECOND +
+				    frames;
+				track->file = nr_files - 1;
+			}
+			g_free(number);
+			g_free(time);
+		}
+		g_free(keyword);
+	}
+	g_strfreev(lines);
+
+	wanted_file = nr_files == 1 ? 0 : matching_file;
+	for (i = 0; i < tracks->len; ++i) {
+		track = &g_array_index(tracks, struct cue_track, i);
+		if (wanted_file >= 0 && track->file == wanted_file) {
+			add_segment(segments,
+			    (size_t)(track->start * samplerate /
+				CUE_FRAMES_PER_SECOND),
+			    track->title);
+		} else {
+			g_free(track->title);
+		}
+	}
+	g_array_free(tracks, TRUE);
+	g_free(basename);
+	g_free(utf8);
+	g_free(contents);
+	return TRUE;
+}
+
+static void
+read_cue_sheet_next_to(char const *filename, unsigned long samplerate,
+    GArray *segments)
+{
+	char const *extension = strrchr(filename, '.');
+	gchar *cue_filename;
+
+	if (extension && !strchr(extension, '/') &&
+	    !strchr(extension, G_DIR_SEPARATOR)) {
+		cue_filename = g_strdup_printf("%.*s.cue",
+		    (int)(extension - filename), filename);
+		if (read_cue_sheet(cue_filename, filename, samplerate,
+			segments)) {
+			g_free(cue_filename);
+			return;
+		}
+		g_free(cue_filename);
+	}
+	cue_filename = g_strconcat(filename, ".cue", NULL);
+	read_cue_sheet(cue_filename, filename, samplerate, segments);
+	g_free(cue_filename);
+}
+
+struct segment_data *
+segments_get(struct input_ops *ops, struct input_handle *ih,
+    char const *filename, unsigned long samplerate, size_t *nr_segments)
+{
+	GArray *segments = g_array_new(FALSE, FALSE,
+	    sizeof(struct segment_data));
+	struct input_chapter *chapters = NULL;
+	size_t nr_chapters = 0;
+	size_t i;
+
+	if (ops->get_chapters) {
+		nr_chapters = ops->get_chapters(ih, &chapters);
+	}
+	for (i = 0; i < nr_chapters; ++i) {
+		add_segment(segments, chapters[i].start,
+		    chapters[i].title ? g_strdup(chapters[i].title) : NULL);
+		free(chapters[i].title);
+	}
+	free(chapters);
+
+	if (!segments->len && strcmp(filename, "-")) {
+		read_cue_sheet_next_to(filename, samplerate, segments);
+	}
+	g_array_sort(segments, compare_segments);
+
+	*nr_segments = segments->len;
+	return (struct segment_data *)g_array_free(segments, !segments->len);
+}
+
+void
+segments_free(struct segment_data *segments, size_t nr_segments)
+{
+	size_t i;
+
+	for (i = 0; i < nr_segments; ++i) {
+		g_free(segments[i].title);
+	}
+	g_free(segments);
+}
+
+gchar *
+segment_display_name(struct segment_data const *segment, size_t index)
+{
+	if (segment->title) {
+		return g_strdup_printf("  %02lu %s", (unsigned long)index + 1,
+		    segment->title);
+	}
+	return g_strdup_printf("  %02lu", (unsigned long)index + 1);
+}
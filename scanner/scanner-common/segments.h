@@ -0,0 +1,35 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <glib.h>
+
+#include "input.h"
+
+/* A part of a file, like a chapter or a track of a cue sheet, that is
+ * measured on its own in the same pass as the whole file. A segment ends
+ * where the next one starts. */
+struct segment_data {
+	gchar *title;
+	size_t start;
+	size_t number_of_frames;
+	double loudness;
+	double lra;
+	double peak;
+	double true_peak;
+};
+
+/* Returns the segments of a file sorted by start, taken from the chapters
+ * of the container or else from a cue sheet next to the file ("NAME.cue" or
+ * "NAME.EXT.cue"). Returns NULL if there are none. */
+struct segment_data *segments_get(struct input_ops *ops,
+    struct input_handle *ih, char const *filename, unsigned long samplerate,
+    size_t *nr_segments);
+void segments_free(struct segment_data *segments, size_t nr_segments);
+
+/* name shown below the file, like "  03 Title" */
+gchar *segment_display_name(struct segment_data const *segment,
+    size_t index);
+
+#endif /* end of include guard: SEGMENTS_H */
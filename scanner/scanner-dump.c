@@ -2,55 +2,946 @@
 
 #include "scanner-dump.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
 
 #include "nproc.h"
 #include "parse_args.h"
 #include "scanner-common.h"
 
+/* knobs: USE_SNDFILE */
+
+#ifdef USE_SNDFILE
+#include <sndfile.h>
+#endif
+
 extern gboolean verbose;
-static double momentary;
-static double shortterm;
-static double integrated;
+static gchar *output_dir = NULL;
 extern gchar *decode_to_file;
 
+/* Every metric is printed at its own interval, some at several; all of them
+ * come from one decode pass. */
+enum dump_metric {
+	DUMP_MOMENTARY,
+	DUMP_SHORTTERM,
+	DUMP_INTEGRATED,
+	DUMP_LRA,
+	DUMP_SAMPLE_PEAK,
+	DUMP_TRUE_PEAK,
+	DUMP_NR_METRICS
+};
+
+static struct {
+	char const *name;
+	int mode;
+	char const *format;
+} const metric_info[DUMP_NR_METRICS] = {
+	{ "M", EBUR128_MODE_M, "%.1f" },
+	{ "S", EBUR128_MODE_S, "%.1f" },
+	{ "I", EBUR128_MODE_I, "%.1f" },
+	{ "LRA", EBUR128_MODE_LRA, "%.1f" },
+	{ "SPK", EBUR128_MODE_SAMPLE_PEAK, "%.6f" },
+	{ "TPK", EBUR128_MODE_TRUE_PEAK, "%.6f" },
+};
+
+/* One decode feeds all sinks of a file. Text and binary dumps go to stdout
+ * or to DIR/NAME.SUFFIX, the summary line always goes to stdout and the
+ * decoded audio to --decode=FILE or DIR/NAME.wav. */
+enum dump_sink {
+	SINK_TEXT,
+	SINK_BINARY,
+	SINK_SUMMARY,
+	SINK_WAV,
+	DUMP_NR_SINKS
+};
+
+static struct {
+	char const *name;
+	char const *suffix;
+} const sink_info[DUMP_NR_SINKS] = {
+	{ "text", "txt" },
+	{ "binary", "bin" },
+	{ "summary", NULL },
+	{ "wav", "wav" },
+};
+
+static gboolean sinks[DUMP_NR_SINKS];
+
+static double intervals[DUMP_NR_METRICS];
+static gboolean binary = FALSE;
+static gchar *sinks_arg = NULL;
+static gboolean from_binary = FALSE;
+static gchar *aggregate = NULL;
+static gchar *envelope = NULL;
+
 static GOptionEntry entries[] = { { "momentary", 'm', 0, G_OPTION_ARG_DOUBLE,
-				      &momentary, NULL, NULL },
-	{ "shortterm", 's', 0, G_OPTION_ARG_DOUBLE, &shortterm, NULL, NULL },
-	{ "integrated", 'i', 0, G_OPTION_ARG_DOUBLE, &integrated, NULL, NULL },
+				      &intervals[DUMP_MOMENTARY], NULL, NULL },
+	{ "shortterm", 's', 0, G_OPTION_ARG_DOUBLE, &intervals[DUMP_SHORTTERM],
+	    NULL, NULL },
+	{ "integrated", 'i', 0, G_OPTION_ARG_DOUBLE,
+	    &intervals[DUMP_INTEGRATED], NULL, NULL },
+	{ "lra", 0, 0, G_OPTION_ARG_DOUBLE, &intervals[DUMP_LRA], NULL, NULL },
+	{ "sample-peak", 0, 0, G_OPTION_ARG_DOUBLE,
+	    &intervals[DUMP_SAMPLE_PEAK], NULL, NULL },
+	{ "true-peak", 0, 0, G_OPTION_ARG_DOUBLE, &intervals[DUMP_TRUE_PEAK],
+	    NULL, NULL },
+	{ "aggregate", 0, 0, G_OPTION_ARG_STRING, &aggregate, NULL, NULL },
+	{ "envelope", 0, 0, G_OPTION_ARG_STRING, &envelope, NULL, NULL },
+	{ "binary", 0, 0, G_OPTION_ARG_NONE, &binary, NULL, NULL },
+	{ "sinks", 0, 0, G_OPTION_ARG_STRING, &sinks_arg, NULL, NULL },
+	{ "from-binary", 0, 0, G_OPTION_ARG_NONE, &from_binary, NULL, NULL },
+	{ "output-dir", 0, 0, G_OPTION_ARG_FILENAME, &output_dir, NULL, NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 } };
 
-static double interval;
 static int r128_mode;
-static ebur128_state *st;
 
+/* How momentary and short-term values are reduced to one per interval:
+ * AGGREGATE_LAST takes the value at the end of the interval, the others
+ * look at the values of all 100ms steps within the interval. */
+enum aggregate_mode {
+	AGGREGATE_LAST,
+	AGGREGATE_MAX,
+	AGGREGATE_MEAN,
+	AGGREGATE_GATED
+};
+
+static enum aggregate_mode aggregate_mode = AGGREGATE_LAST;
+#define AGGREGATE_STEP 0.1
+
+/* A series is one metric at one interval. --envelope adds maximum momentary
+ * and short-term series at several intervals, a pyramid for overviews. */
+struct dump_series {
+	enum dump_metric metric;
+	double interval;
+	enum aggregate_mode aggregate;
+};
+
+#define MAX_SERIES 64
+static struct dump_series series[MAX_SERIES];
+static int nr_series;
+
+/* "M" if a metric has one series, "M@10" if it has several; NULL if there
+ * is only one series at all and it is not aggregated, which keeps the plain
+ * one value per line format. Aggregated values stand for a whole interval,
+ * so they are always printed with the time. */
+static gchar *
+get_series_label(struct dump_series const *all, int n, int index)
+{
+	enum dump_metric metric = all[index].metric;
+	int nr_same = 0;
+	int i;
+
+	if (n == 1 && all[index].aggregate == AGGREGATE_LAST) {
+		return NULL;
+	}
+	for (i = 0; i < n; ++i) {
+		nr_same += all[i].metric == metric;
+	}
+	if (nr_same > 1) {
+		return g_strdup_printf("%s@%g", metric_info[metric].name,
+		    all[index].interval);
+	}
+	return g_strdup(metric_info[metric].name);
+}
+
+/* Files are dumped concurrently, each with its own state. Text is written
+ * while decoding, to its own file in output_dir or to stdout in list order:
+ * the first file not printed yet writes to stdout directly, the files after
+ * it hold their text back in a temporary file until it is their turn. The
+ * columns of a binary dump are spooled to temporary files and follow the
+ * header once their lengths are known. Only the summary line is kept in
+ * memory until the file is printed. The spill file and the streaming flag
+ * belong to the text writer thread of the job until it is done. */
+struct dump_job {
+	struct filename_list_node *fln;
+	guint index;
+	gchar *output_filename[DUMP_NR_SINKS];
+	FILE *output_file[DUMP_NR_SINKS];
+	GString *summary;
+	FILE *spill;
+	gboolean streaming; /* text goes to stdout directly */
+	int error;
+	gboolean done;
+};
+
+static GMutex dump_mutex;
+static GCond dump_cond;
+static guint next_to_print; /* the job that may write to stdout */
+static gboolean print_file_names;
+
+/* Interval boundaries are rounded from the start of the file, so they don't
+ * drift. Peaks are the maximum since the last value of the series. */
+struct series_clock {
+	guint64 nr_intervals;
+	guint64 next;
+	double peak;
+	GArray *steps; /* loudness of each step, if aggregated */
+	gchar *label;
+};
+
+static double
+energy_to_loudness(double energy)
+{
+	return energy > 0.0 ? 10.0 * log10(energy) : -HUGE_VAL;
+}
+
+/* mean energy of the steps at or above threshold */
+static double
+get_mean_energy(GArray *steps, double threshold)
+{
+	double sum = 0.0;
+	guint nr_steps = 0;
+	guint i;
+
+	for (i = 0; i < steps->len; ++i) {
+		double loudness = g_array_index(steps, double, i);
+		if (loudness >= threshold) {
+			sum += pow(10.0, loudness / 10.0);
+			++nr_steps;
+		}
+	}
+	return nr_steps ? sum / nr_steps : 0.0;
+}
+
+/* Reduces the steps of an interval. Momentary values 100ms apart are the
+ * gating blocks of BS.1770, so "gated" gives the integrated loudness of the
+ * interval. */
+static double
+get_aggregated_value(GArray *steps, enum aggregate_mode mode)
+{
+	double value = -HUGE_VAL;
+	double relative_threshold;
+	guint i;
+
+	switch (mode) {
+	case AGGREGATE_MAX:
+		for (i = 0; i < steps->len; ++i) {
+			value = MAX(value, g_array_index(steps, double, i));
+		}
+		break;
+	case AGGREGATE_MEAN:
+		value = energy_to_loudness(get_mean_energy(steps, -HUGE_VAL));
+		break;
+	case AGGREGATE_GATED:
+		relative_threshold = energy_to_loudness(
+					 get_mean_energy(steps, -70.0)) -
+		    10.0;
+		value = energy_to_loudness(get_mean_energy(steps,
+		    MAX(-70.0, relative_threshold)));
+		break;
+	default:
+		abort();
+	}
+	g_array_set_size(steps, 0);
+	return value;
+}
+
+static guint64
+get_boundary(double interval, guint64 nr_intervals, unsigned long samplerate)
+{
+	return (guint64)((double)nr_intervals * interval * (double)samplerate +
+	    0.5);
+}
+
+static void
+update_peaks(ebur128_state *st, struct series_clock *clocks)
+{
+	double sample_peak = 0.0;
+	double true_peak = 0.0;
+	unsigned i;
+	int k;
+
+	for (i = 0; i < st->channels; ++i) {
+		double peak;
+		if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) ==
+		    EBUR128_MODE_SAMPLE_PEAK) {
+			ebur128_prev_sample_peak(st, i, &peak);
+			sample_peak = MAX(sample_peak, peak);
+		}
+		if ((st->mode & EBUR128_MODE_TRUE_PEAK) ==
+		    EBUR128_MODE_TRUE_PEAK) {
+			ebur128_prev_true_peak(st, i, &peak);
+			true_peak = MAX(true_peak, peak);
+		}
+	}
+	for (k = 0; k < nr_series; ++k) {
+		if (series[k].metric == DUMP_SAMPLE_PEAK) {
+			clocks[k].peak = MAX(clocks[k].peak, sample_peak);
+		} else if (series[k].metric == DUMP_TRUE_PEAK) {
+			clocks[k].peak = MAX(clocks[k].peak, true_peak);
+		}
+	}
+}
+
+static double
+get_series_value(ebur128_state *st, struct dump_series const *ds,
+    struct series_clock *clock)
+{
+	double value;
+
+	if (clock->steps && clock->steps->len > 0) {
+		return get_aggregated_value(clock->steps, ds->aggregate);
+	}
+
+	switch (ds->metric) {
+	case DUMP_MOMENTARY:
+		ebur128_loudness_momentary(st, &value);
+		break;
+	case DUMP_SHORTTERM:
+		ebur128_loudness_shortterm(st, &value);
+		break;
+	case DUMP_INTEGRATED:
+		ebur128_loudness_global(st, &value);
+		break;
+	case DUMP_LRA:
+		ebur128_loudness_range(st, &value);
+		break;
+	case DUMP_SAMPLE_PEAK:
+	case DUMP_TRUE_PEAK:
+		value = clock->peak;
+		clock->peak = 0.0;
+		break;
+	default:
+		fprintf(stderr, "Invalid mode!\n");
+		abort();
+	}
+	return value;
+}
+
+static void
+append_text_value(GString *output, enum dump_metric metric,
+    char const *label, double seconds, double value)
+{
+	if (label) {
+		g_string_append_printf(output, "%.3f %s ", seconds, label);
+	}
+	g_string_append_printf(output, metric_info[metric].format, value);
+	g_string_append_c(output, '\n');
+}
+
+/* The sinks of a file are written from threads of their own, each fed in
+ * chunks from a fixed pool, so a slow disk or a slow reader of stdout only
+ * holds up the decode once all chunks of a sink are in flight. */
+#define SINK_CHUNKS 8
+
+struct sink_chunk {
+	char *data;
+	size_t capacity;
+	size_t size; /* 0 ends the stream */
+};
+
+struct sink_writer {
+	GThread *thread;
+	GAsyncQueue *full_chunks;
+	GAsyncQueue *free_chunks;
+	struct sink_chunk chunks[SINK_CHUNKS];
+	/* returns nonzero on errors, after which nothing more is written */
+	int (*write_chunk)(gpointer sink, char const *data, size_t size);
+	gpointer sink;
+	int error;
+};
+
+static gpointer
+sink_writer_thread(gpointer data)
+{
+	struct sink_writer *writer = data;
+	struct sink_chunk *chunk;
+
+	while ((chunk = g_async_queue_pop(writer->full_chunks))->size) {
+		if (!writer->error &&
+		    writer->write_chunk(writer->sink, chunk->data,
+			chunk->size)) {
+			writer->error = 1;
+		}
+		g_async_queue_push(writer->free_chunks, chunk);
+	}
+	return NULL;
+}
+
+static struct sink_writer *
+sink_writer_open(char const *name,
+    int (*write_chunk)(gpointer sink, char const *data, size_t size),
+    gpointer sink)
+{
+	struct sink_writer *writer = g_new0(struct sink_writer, 1);
+	int i;
+
+	writer->write_chunk = write_chunk;
+	writer->sink = sink;
+	writer->full_chunks = g_async_queue_new();
+	writer->free_chunks = g_async_queue_new();
+	for (i = 0; i < SINK_CHUNKS; ++i) {
+		g_async_queue_push(writer->free_chunks, &writer->chunks[i]);
+	}
+	writer->thread = g_thread_new(name, sink_writer_thread, writer);
+	return writer;
+}
+
+static void
+sink_writer_write(struct sink_writer *writer, void const *data, size_t size)
+{
+	struct sink_chunk *chunk;
+
+	if (!size) {
+		return;
+	}
+	chunk = g_async_queue_pop(writer->free_chunks);
+	if (chunk->capacity < size) {
+		chunk->data = g_realloc(chunk->data, size);
+		chunk->capacity = size;
+	}
+	memcpy(chunk->data, data, size);
+	chunk->size = size;
+	g_async_queue_push(writer->full_chunks, chunk);
+}
+
+/* Waits for all chunks to be written. Returns nonzero if not all of them
+ * could be. */
+static int
+sink_writer_close(struct sink_writer *writer)
+{
+	struct sink_chunk *chunk = g_async_queue_pop(writer->free_chunks);
+	int error;
+	int i;
+
+	chunk->size = 0;
+	g_async_queue_push(writer->full_chunks, chunk);
+	g_thread_join(writer->thread);
+
+	error = writer->error;
+	for (i = 0; i < SINK_CHUNKS; ++i) {
+		g_free(writer->chunks[i].data);
+	}
+	g_async_queue_unref(writer->full_chunks);
+	g_async_queue_unref(writer->free_chunks);
+	g_free(writer);
+	return error;
+}
+
+/* Appends all of a temporary file to output. Returns nonzero on errors. */
+static int
+copy_temporary_file(FILE *file, FILE *output)
+{
+	char data[BUFSIZ];
+	size_t size;
+
+	if (fflush(file) || ferror(file)) {
+		return 1;
+	}
+	rewind(file);
+	while ((size = fread(data, 1, sizeof data, file)) > 0) {
+		if (fwrite(data, 1, size, output) != size) {
+			return 1;
+		}
+	}
+	return ferror(file);
+}
+
+/* Copies the text held back so far to stdout, after the name of the file if
+ * there are several; the job writes there directly from now on. */
+static int
+start_printing(struct dump_job *job)
+{
+	int error;
+
+	job->streaming = TRUE;
+	if (print_file_names) {
+		printf("# ");
+		print_utf8_string(job->fln->fr->display);
+		putchar('\n');
+	}
+	if (!job->spill) {
+		return 0;
+	}
+	error = copy_temporary_file(job->spill, stdout);
+	fclose(job->spill);
+	job->spill = NULL;
+	return error;
+}
+
+/* A dump hands its text to the writer after every decoded buffer, a
+ * conversion whenever it has this much. */
+#define TEXT_CHUNK_SIZE 65536
+
+/* the text sink of a job */
+static int
+write_text(gpointer sink, char const *data, size_t size)
+{
+	struct dump_job *job = sink;
+	FILE *file = job->output_file[SINK_TEXT];
+	gboolean is_next;
+	int error = 0;
+
+	if (!file && !job->streaming) {
+		g_mutex_lock(&dump_mutex);
+		is_next = job->index == next_to_print;
+		g_mutex_unlock(&dump_mutex);
+		if (is_next) {
+			error = start_printing(job);
+		} else if (!job->spill && !(job->spill = tmpfile())) {
+			g_message("Could not create a temporary file");
+			return 1;
+		}
+	}
+	if (!file) {
+		file = job->streaming ? stdout : job->spill;
+	}
+	return fwrite(data, 1, size, file) != size || error;
+}
+
+/* The binary format, all little endian, is laid out for mmap:
+ *
+ *   0  "LOUDDUMP", u32 version, u32 header size, u32 sample rate,
+ *      u32 channels, u32 number of series, u32 reserved, u64 frames
+ *  40  per series: u32 metric, u32 aggregation, f64 interval, u64 count
+ *      then i32 channel map (libebur128 channels), padded to 8 bytes
+ *
+ * followed by one column of f32 values per series, in header order. The
+ * value k of a series belongs to the interval that ends at frame
+ * round((k + 1) * interval * sample rate), or at the last frame for the
+ * value of a partial interval at the end of an aggregated series. The
+ * header needs the length of every column, so the writer thread spools the
+ * columns to temporary files while decoding and the dump is put together
+ * once all values are in. */
+#define BINARY_MAGIC "LOUDDUMP"
+#define BINARY_VERSION 1
+#define BINARY_FIXED_HEADER_SIZE 40
+#define BINARY_METRIC_SIZE 24
+
+static void
+append_u32(GString *output, guint32 value)
+{
+	value = GUINT32_TO_LE(value);
+	g_string_append_len(output, (gchar const *)&value, 4);
+}
+
+static void
+append_u64(GString *output, guint64 value)
+{
+	value = GUINT64_TO_LE(value);
+	g_string_append_len(output, (gchar const *)&value, 8);
+}
+
+static guint32
+read_u32(guchar const *data)
+{
+	guint32 value;
+	memcpy(&value, data, 4);
+	return GUINT32_FROM_LE(value);
+}
+
+static guint64
+read_u64(guchar const *data)
+{
+	guint64 value;
+	memcpy(&value, data, 8);
+	return GUINT64_FROM_LE(value);
+}
+
+/* what the decode hands to the binary sink for every value */
+struct column_value {
+	guint32 series;
+	float value;
+};
+
+struct binary_columns {
+	FILE *files[MAX_SERIES];
+	guint64 nr_values[MAX_SERIES];
+};
+
+/* the binary sink of a job, appends each value to its column */
+static int
+write_column_values(gpointer sink, char const *data, size_t size)
+{
+	struct binary_columns *columns = sink;
+	struct column_value const *values = (struct column_value const *)data;
+	size_t i;
+
+	for (i = 0; i < size / sizeof *values; ++i) {
+		guint32 k = values[i].series;
+		guint32 bits;
+
+		memcpy(&bits, &values[i].value, 4);
+		bits = GUINT32_TO_LE(bits);
+		if (fwrite(&bits, 4, 1, columns->files[k]) != 1) {
+			return 1;
+		}
+		++columns->nr_values[k];
+	}
+	return 0;
+}
+
+/* Returns nonzero if the dump could not be written. */
+static int
+write_binary_dump(FILE *file, ebur128_state *st, int const *channel_map,
+    struct binary_columns *columns, guint64 nr_frames)
+{
+	GString *output = g_string_new(NULL);
+	gsize header_size = BINARY_FIXED_HEADER_SIZE +
+	    (gsize)nr_series * BINARY_METRIC_SIZE + st->channels * 4;
+	int error;
+	guint i;
+	int k;
+
+	header_size = (header_size + 7) & ~(gsize)7;
+	g_string_append_len(output, BINARY_MAGIC, 8);
+	append_u32(output, BINARY_VERSION);
+	append_u32(output, (guint32)header_size);
+	append_u32(output, (guint32)st->samplerate);
+	append_u32(output, st->channels);
+	append_u32(output, (guint32)nr_series);
+	append_u32(output, 0);
+	append_u64(output, nr_frames);
+	for (k = 0; k < nr_series; ++k) {
+		guint64 interval_bits;
+		memcpy(&interval_bits, &series[k].interval, 8);
+		append_u32(output, (guint32)series[k].metric);
+		append_u32(output, (guint32)series[k].aggregate);
+		append_u64(output, interval_bits);
+		append_u64(output, columns->nr_values[k]);
+	}
+	for (i = 0; i < st->channels; ++i) {
+		append_u32(output, (guint32)channel_map[i]);
+	}
+	while (output->len % 8) {
+		g_string_append_c(output, '\0');
+	}
+	error = fwrite(output->str, 1, output->len, file) != output->len;
+	g_string_free(output, TRUE);
+
+	for (k = 0; !error && k < nr_series; ++k) {
+		error = copy_temporary_file(columns->files[k], file);
+	}
+	return error;
+}
+
+/* Prints a binary dump in the text format, in the order a text dump would
+ * have had. Returns nonzero if the file is no valid binary dump. */
+static int
+convert_binary_dump(struct dump_job *job)
+{
+	struct filename_list_node *fln = job->fln;
+	struct sink_writer *writer;
+	GString *text;
+	GMappedFile *file;
+	guchar const *data;
+	gsize size;
+	gsize header_size;
+	guint32 samplerate;
+	guint32 nr_file_series;
+	guint64 nr_frames;
+	struct dump_series file_series[MAX_SERIES];
+	struct {
+		guint64 count;
+		guchar const *values;
+		guint64 nr_values;
+		guint64 next;
+		gchar *label;
+	} columns[MAX_SERIES];
+	gsize offset;
+	guint32 i;
+	int ret = 1;
+
+	file = g_mapped_file_new(fln->fr->raw, FALSE, NULL);
+	if (!file) {
+		g_message("Could not open %s", fln->fr->display);
+		return 1;
+	}
+	data = (guchar const *)g_mapped_file_get_contents(file);
+	size = g_mapped_file_get_length(file);
+	if (size < BINARY_FIXED_HEADER_SIZE ||
+	    memcmp(data, BINARY_MAGIC, 8) || read_u32(data + 8) != BINARY_VERSION) {
+		goto invalid;
+	}
+	header_size = read_u32(data + 12);
+	samplerate = read_u32(data + 16);
+	nr_file_series = read_u32(data + 24);
+	nr_frames = read_u64(data + 32);
+	if (!samplerate || nr_file_series > MAX_SERIES ||
+	    header_size > size ||
+	    header_size < BINARY_FIXED_HEADER_SIZE +
+		    nr_file_series * BINARY_METRIC_SIZE) {
+		goto invalid;
+	}
+
+	offset = header_size;
+	for (i = 0; i < nr_file_series; ++i) {
+		guchar const *entry = data + BINARY_FIXED_HEADER_SIZE +
+		    i * BINARY_METRIC_SIZE;
+		guint64 interval_bits = read_u64(entry + 8);
+
+		file_series[i].metric = (enum dump_metric)read_u32(entry);
+		file_series[i].aggregate = (enum aggregate_mode)read_u32(
+		    entry + 4);
+		memcpy(&file_series[i].interval, &interval_bits, 8);
+		columns[i].count = read_u64(entry + 16);
+		if (file_series[i].metric >= DUMP_NR_METRICS ||
+		    !(file_series[i].interval > 0.0) ||
+		    columns[i].count > (size - offset) / 4) {
+			goto invalid;
+		}
+		columns[i].values = data + offset;
+		columns[i].nr_values = 0;
+		columns[i].next = get_boundary(file_series[i].interval, 1,
+		    samplerate);
+		offset += columns[i].count * 4;
+	}
+	for (i = 0; i < nr_file_series; ++i) {
+		columns[i].label = get_series_label(file_series,
+		    (int)nr_file_series, (int)i);
+	}
+
+	/* merge the columns by time; ties go in header order */
+	text = g_string_new(NULL);
+	writer = sink_writer_open("text-writer", write_text, job);
+	for (;;) {
+		guint32 first = nr_file_series;
+		guint32 bits;
+		float value;
+
+		for (i = 0; i < nr_file_series; ++i) {
+			if (columns[i].nr_values < columns[i].count &&
+			    (first == nr_file_series ||
+				columns[i].next < columns[first].next)) {
+				first = i;
+			}
+		}
+		if (first == nr_file_series) {
+			break;
+		}
+		bits = read_u32(columns[first].values +
+		    columns[first].nr_values * 4);
+		memcpy(&value, &bits, 4);
+		append_text_value(text, file_series[first].metric,
+		    columns[first].label,
+		    (double)MIN(columns[first].next, nr_frames) / samplerate,
+		    value);
+		columns[first].next = get_boundary(file_series[first].interval,
+		    ++columns[first].nr_values + 1, samplerate);
+		if (text->len >= TEXT_CHUNK_SIZE) {
+			sink_writer_write(writer, text->str, text->len);
+			g_string_truncate(text, 0);
+		}
+	}
+	sink_writer_write(writer, text->str, text->len);
+	ret = sink_writer_close(writer);
+	if (ret) {
+		g_message("Could not write the text of %s", fln->fr->display);
+	}
+	g_string_free(text, TRUE);
+	for (i = 0; i < nr_file_series; ++i) {
+		g_free(columns[i].label);
+	}
+	goto out;
+
+invalid:
+	g_message("%s is no binary loudness dump", fln->fr->display);
+out:
+	g_mapped_file_unref(file);
+	return ret;
+}
+
+#ifdef USE_SNDFILE
+/* the wav sink, the decoded audio as it comes */
+static int
+write_wav(gpointer sink, char const *data, size_t size)
+{
+	sf_count_t samples = (sf_count_t)(size / sizeof(float));
+
+	return sf_write_float(sink, (float const *)data, samples) != samples;
+}
+
+static struct sink_writer *
+wav_writer_open(char const *filename, ebur128_state *st)
+{
+	SNDFILE *file;
+	SF_INFO sf_info;
+
+	memset(&sf_info, '\0', sizeof sf_info);
+	sf_info.samplerate = (int)st->samplerate;
+	sf_info.channels = (int)st->channels;
+	sf_info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+	file = sf_open(filename, SFM_WRITE, &sf_info);
+	if (!file) {
+		g_message("Could not open %s: %s", filename,
+		    sf_strerror(NULL));
+		return NULL;
+	}
+	return sink_writer_open("wav-writer", write_wav, file);
+}
+
+/* Returns nonzero if not all audio could be written. */
+static int
+wav_writer_close(struct sink_writer *writer, char const *filename)
+{
+	SNDFILE *file = writer->sink;
+	int error = sink_writer_close(writer);
+
+	if (error) {
+		g_message("Could not write %s: %s", filename,
+		    sf_strerror(file));
+	}
+	return sf_close(file) || error;
+}
+#endif
+
+/* the summary of the whole file, formatted like a line of "loudness scan" */
 static void
-dump_loudness_info(struct filename_list_node *fln, int *ret)
+append_summary(GString *output, ebur128_state *st)
 {
+	double loudness;
+	double lra;
+	double sample_peak = 0.0;
+	double true_peak = 0.0;
+	unsigned i;
+
+	ebur128_loudness_global(st, &loudness);
+	ebur128_loudness_range(st, &lra);
+	if (loudness <= -HUGE_VAL) {
+		g_string_append(output, " -inf LUFS");
+	} else {
+		g_string_append_printf(output, "%5.1f LUFS", loudness);
+	}
+	g_string_append_printf(output, ", %4.1f LU", lra);
+	for (i = 0; i < st->channels; ++i) {
+		double peak;
+		ebur128_sample_peak(st, i, &peak);
+		sample_peak = MAX(sample_peak, peak);
+		if ((st->mode & EBUR128_MODE_TRUE_PEAK) ==
+		    EBUR128_MODE_TRUE_PEAK) {
+			ebur128_true_peak(st, i, &peak);
+			true_peak = MAX(true_peak, peak);
+		}
+	}
+	g_string_append_printf(output, ", %11.6f", sample_peak);
+	if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+		if (true_peak <= 0.0) {
+			g_string_append(output, ",  -inf dBTP");
+		} else {
+			g_string_append_printf(output, ", %5.1f dBTP",
+			    20.0 * log10(true_peak));
+		}
+	}
+}
+
+static void
+emit_value(ebur128_state *st, int k, struct series_clock *clock,
+    guint64 position, GString *text, GArray *values)
+{
+	double value = get_series_value(st, &series[k], clock);
+
+	if (values) {
+		struct column_value column_value = { (guint32)k,
+			(float)value };
+		g_array_append_val(values, column_value);
+	}
+	if (text) {
+		append_text_value(text, series[k].metric, clock->label,
+		    (double)position / (double)st->samplerate, value);
+	}
+}
+
+/* Passes the values of a decoded buffer on to the writers. */
+static void
+hand_over_values(struct sink_writer *text_writer, GString *text,
+    struct sink_writer *binary_writer, GArray *values)
+{
+	if (text_writer) {
+		sink_writer_write(text_writer, text->str, text->len);
+		g_string_truncate(text, 0);
+	}
+	if (binary_writer) {
+		sink_writer_write(binary_writer, values->data,
+		    values->len * sizeof(struct column_value));
+		g_array_set_size(values, 0);
+	}
+}
+
+static void
+add_step(ebur128_state *st, struct series_clock *clocks)
+{
+	double momentary = 0.0;
+	double shortterm = 0.0;
+	int k;
+
+	if (st->mode & EBUR128_MODE_M) {
+		ebur128_loudness_momentary(st, &momentary);
+	}
+	if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
+		ebur128_loudness_shortterm(st, &shortterm);
+	}
+	for (k = 0; k < nr_series; ++k) {
+		if (!clocks[k].steps) {
+			continue;
+		}
+		if (series[k].metric == DUMP_MOMENTARY) {
+			g_array_append_val(clocks[k].steps, momentary);
+		} else {
+			g_array_append_val(clocks[k].steps, shortterm);
+		}
+	}
+}
+
+static int
+dump_loudness_info(struct dump_job *job)
+{
+	struct filename_list_node *fln = job->fln;
+	GString *text = NULL;
+	GArray *values = NULL;
+	struct binary_columns columns;
+	struct sink_writer *text_writer = NULL;
+	struct sink_writer *binary_writer = NULL;
+	FILE *binary_file;
 	struct input_ops *ops = NULL;
 	struct input_handle *ih = NULL;
+	ebur128_state *st = NULL;
 	float *buffer = NULL;
+	struct series_clock clocks[MAX_SERIES];
+	struct series_clock step;
+	gboolean use_steps = FALSE;
+	int *channel_map = NULL;
+	guint64 position = 0;
+	unsigned i;
+	int k;
+	int sink_error = 0;
+#ifdef USE_SNDFILE
+	struct sink_writer *wav = NULL;
+#endif
 
 	int result;
-	static size_t nr_frames_read;
-	static size_t frames_counter, frames_needed;
+	size_t nr_frames_read;
 
+	memset(clocks, '\0', sizeof clocks);
+	memset(&columns, '\0', sizeof columns);
 	result = open_plugin(fln->fr->raw, fln->fr->display, &ops, &ih);
 	if (result) {
-		*ret = EXIT_FAILURE;
 		goto free;
 	}
 
-	if (!st) {
-		st = ebur128_init(ops->get_channels(ih),
-		    ops->get_samplerate(ih), r128_mode);
-		if (!st)
-			abort();
+	st = ebur128_init(ops->get_channels(ih), ops->get_samplerate(ih),
+	    r128_mode);
+	if (!st)
+		abort();
+
+	/* without a map from the plugin, libebur128 uses L, R, C, -, Ls, Rs */
+	channel_map = g_new(int, st->channels);
+	if (!ops->set_channel_map(ih, channel_map)) {
+		for (i = 0; i < st->channels; ++i) {
+			ebur128_set_channel(st, i, channel_map[i]);
+		}
 	} else {
-		if (!ebur128_change_parameters(st, ops->get_channels(ih),
-			ops->get_samplerate(ih))) {
-			frames_counter = 0;
+		static int const default_map[] = { EBUR128_LEFT,
+			EBUR128_RIGHT, EBUR128_CENTER, EBUR128_UNUSED,
+			EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND };
+		for (i = 0; i < st->channels; ++i) {
+			channel_map[i] = i < G_N_ELEMENTS(default_map) ?
+				  default_map[i] :
+				  EBUR128_UNUSED;
 		}
 	}
 
@@ -59,90 +950,402 @@ dump_loudness_info(struct filename_list_node *fln, int *ret)
 		abort();
 	buffer = ops->get_buffer(ih);
 
-	frames_needed = (size_t)(interval * (double)st->samplerate + 0.5);
+#ifdef USE_SNDFILE
+	if (job->output_filename[SINK_WAV]) {
+		wav = wav_writer_open(job->output_filename[SINK_WAV], st);
+		if (!wav) {
+			sink_error = 1;
+			goto free;
+		}
+	}
+#endif
+
+	if (sinks[SINK_BINARY]) {
+		for (k = 0; k < nr_series; ++k) {
+			columns.files[k] = tmpfile();
+			if (!columns.files[k]) {
+				g_message("Could not create a temporary file");
+				sink_error = 1;
+				goto out;
+			}
+		}
+		values = g_array_new(FALSE, FALSE,
+		    sizeof(struct column_value));
+		binary_writer = sink_writer_open("binary-writer",
+		    write_column_values, &columns);
+	}
+	if (sinks[SINK_TEXT]) {
+		text = g_string_new(NULL);
+		text_writer = sink_writer_open("text-writer", write_text, job);
+	}
+	for (k = 0; k < nr_series; ++k) {
+		clocks[k].nr_intervals = 1;
+		clocks[k].next = get_boundary(series[k].interval, 1,
+		    st->samplerate);
+		if (series[k].aggregate != AGGREGATE_LAST) {
+			clocks[k].steps = g_array_new(FALSE, FALSE,
+			    sizeof(double));
+			use_steps = TRUE;
+		}
+		if (text) {
+			clocks[k].label = get_series_label(series, nr_series,
+			    k);
+		}
+	}
+	step.nr_intervals = 1;
+	step.next = get_boundary(AGGREGATE_STEP, 1, st->samplerate);
 
 	while ((nr_frames_read = ops->read_frames(ih))) {
 		float *tmp_buffer = buffer;
-		double loudness;
+#ifdef USE_SNDFILE
+		if (wav) {
+			sink_writer_write(wav, buffer,
+			    nr_frames_read * st->channels * sizeof(float));
+		}
+#endif
 		while (nr_frames_read > 0) {
-			if (frames_counter + nr_frames_read >= frames_needed) {
-				result = ebur128_add_frames_float(st,
-				    tmp_buffer, frames_needed - frames_counter);
-				if (result)
-					abort();
-				tmp_buffer += (frames_needed - frames_counter) *
-				    st->channels;
-				nr_frames_read -= frames_needed -
-				    frames_counter;
-				frames_counter = 0;
-				switch (r128_mode) {
-				case EBUR128_MODE_M:
-					ebur128_loudness_momentary(st,
-					    &loudness);
-					printf("%.1f\n", loudness);
-					break;
-				case EBUR128_MODE_S:
-					ebur128_loudness_shortterm(st,
-					    &loudness);
-					printf("%.1f\n", loudness);
-					break;
-				case EBUR128_MODE_I:
-					ebur128_loudness_global(st, &loudness);
-					printf("%.1f\n", loudness);
-					break;
-				default:
-					fprintf(stderr, "Invalid mode!\n");
-					abort();
+			guint64 next = position + nr_frames_read;
+			size_t frames;
+
+			for (k = 0; k < nr_series; ++k) {
+				if (clocks[k].next < next) {
+					next = clocks[k].next;
 				}
-			} else {
+			}
+			if (use_steps && step.next < next) {
+				next = step.next;
+			}
+			frames = (size_t)(next - position);
+			if (frames > 0) {
 				result = ebur128_add_frames_float(st,
-				    tmp_buffer, nr_frames_read);
+				    tmp_buffer, frames);
 				if (result)
 					abort();
-				tmp_buffer += (nr_frames_read)*st->channels;
-				frames_counter += nr_frames_read;
-				nr_frames_read = 0;
+				update_peaks(st, clocks);
+				tmp_buffer += frames * st->channels;
+				nr_frames_read -= frames;
+				position = next;
+			}
+			if (use_steps && step.next == position) {
+				add_step(st, clocks);
+				step.next = get_boundary(AGGREGATE_STEP,
+				    ++step.nr_intervals, st->samplerate);
+			}
+			for (k = 0; k < nr_series; ++k) {
+				if (clocks[k].next != position) {
+					continue;
+				}
+				emit_value(st, k, &clocks[k], position, text,
+				    values);
+				clocks[k].next = get_boundary(
+				    series[k].interval,
+				    ++clocks[k].nr_intervals, st->samplerate);
 			}
 		}
+		hand_over_values(text_writer, text, binary_writer, values);
+	}
+	/* in an aggregated series, the frames after the last full interval
+	 * get a value of their own; plain series end with the last interval
+	 * as they always have */
+	for (k = 0; k < nr_series; ++k) {
+		if (series[k].aggregate != AGGREGATE_LAST &&
+		    position > get_boundary(series[k].interval,
+				   clocks[k].nr_intervals - 1,
+				   st->samplerate)) {
+			emit_value(st, k, &clocks[k], position, text, values);
+		}
+	}
+	hand_over_values(text_writer, text, binary_writer, values);
+	if (job->summary) {
+		append_summary(job->summary, st);
 	}
 
+out:
+	if (text_writer && sink_writer_close(text_writer)) {
+		g_message("Could not write the text of %s", fln->fr->display);
+		sink_error = 1;
+	}
+	/* the header is written last, with the final length of each column;
+	 * on stdout, a binary dump is the only output of the only file */
+	binary_file = job->output_file[SINK_BINARY];
+	if (binary_writer && (sink_writer_close(binary_writer) ||
+		write_binary_dump(binary_file ? binary_file : stdout, st,
+		    channel_map, &columns, position))) {
+		g_message("Could not write the binary dump of %s",
+		    fln->fr->display);
+		sink_error = 1;
+	}
+#ifdef USE_SNDFILE
+	if (wav && wav_writer_close(wav, job->output_filename[SINK_WAV])) {
+		sink_error = 1;
+	}
+#endif
 free:
+	for (k = 0; k < nr_series; ++k) {
+		if (columns.files[k])
+			fclose(columns.files[k]);
+		if (clocks[k].steps)
+			g_array_free(clocks[k].steps, TRUE);
+		g_free(clocks[k].label);
+	}
+	if (text)
+		g_string_free(text, TRUE);
+	if (values)
+		g_array_free(values, TRUE);
+	g_free(channel_map);
+	if (st)
+		ebur128_destroy(&st);
 	if (ih)
 		ops->free_buffer(ih);
 	if (!result)
 		ops->close_file(ih);
 	if (ih)
 		ops->handle_destroy(&ih);
+	return result || sink_error;
+}
+
+static void
+dump_job_work_item(struct dump_job *job, gpointer unused)
+{
+	int error = 0;
+	int s;
+
+	(void)unused;
+	/* the wav sink opens its file through libsndfile */
+	for (s = 0; !error && s < SINK_WAV; ++s) {
+		if (job->output_filename[s] &&
+		    !(job->output_file[s] = g_fopen(job->output_filename[s],
+			  "wb"))) {
+			g_message("Could not open %s", job->output_filename[s]);
+			error = 1;
+		}
+	}
+	if (!error) {
+		error = from_binary ? convert_binary_dump(job) :
+				      dump_loudness_info(job);
+	}
+	for (s = 0; s < SINK_WAV; ++s) {
+		if (job->output_file[s] && fclose(job->output_file[s]) &&
+		    !error) {
+			g_message("Could not write %s",
+			    job->output_filename[s]);
+			error = 1;
+		}
+	}
+
+	g_mutex_lock(&dump_mutex);
+	job->error = error;
+	job->done = TRUE;
+	g_cond_broadcast(&dump_cond);
+	g_mutex_unlock(&dump_mutex);
+}
+
+/* "DIR/BASENAME", numbered if several inputs share a basename; the sinks
+ * add their suffix */
+static gchar *
+get_output_stem(struct filename_list_node *fln, GHashTable *used_names)
+{
+	gchar *basename = g_path_get_basename(fln->fr->raw);
+	gchar *name = g_strdup(basename);
+	gchar *stem;
+	int i;
+
+	for (i = 2; g_hash_table_contains(used_names, name); ++i) {
+		g_free(name);
+		name = g_strdup_printf("%s-%d", basename, i);
+	}
+	g_hash_table_add(used_names, name);
+	stem = g_build_filename(output_dir, name, NULL);
+	g_free(basename);
+
+	return stem;
+}
+
+static void
+init_dump_job(struct dump_job *job, struct filename_list_node *fln,
+    guint index, GHashTable *used_names)
+{
+	gchar *stem = output_dir ? get_output_stem(fln, used_names) : NULL;
+	int s;
+
+	job->fln = fln;
+	job->index = index;
+	for (s = 0; s < DUMP_NR_SINKS; ++s) {
+		if (!sinks[s]) {
+			continue;
+		}
+		if (s == SINK_SUMMARY) {
+			job->summary = g_string_new(NULL);
+		}
+		if (s == SINK_WAV && decode_to_file) {
+			job->output_filename[s] = g_strdup(decode_to_file);
+		} else if (stem && sink_info[s].suffix) {
+			job->output_filename[s] = g_strconcat(stem, ".",
+			    sink_info[s].suffix, NULL);
+		}
+	}
+	g_free(stem);
+}
+
+/* Prints what goes to stdout and is not printed yet. With text on stdout as
+ * well, the summary is a comment line like the file header. */
+static void
+print_dump_job(struct dump_job *job)
+{
+	gboolean text = sinks[SINK_TEXT] && !job->output_filename[SINK_TEXT];
+	GString *summary = job->summary;
+
+	if (text && !job->streaming) {
+		start_printing(job);
+	}
+	if (summary) {
+		if (text) {
+			printf("# ");
+		}
+		fwrite(summary->str, 1, summary->len, stdout);
+		printf(", ");
+		print_utf8_string(job->fln->fr->display);
+		putchar('\n');
+	}
+	fflush(stdout);
 }
 
 int
 loudness_dump(GSList *files)
 {
+	guint nr_files = g_slist_length(files);
+	struct dump_job *jobs;
+	GHashTable *used_names;
+	GThreadPool *pool;
 	int ret = 0;
+	guint i;
+	int k;
+	int s;
 
-	if (momentary > 0.0)
-		r128_mode = EBUR128_MODE_M;
-	else if (shortterm > 0.0)
-		r128_mode = EBUR128_MODE_S;
-	else if (integrated > 0.0)
-		r128_mode = EBUR128_MODE_I;
-	else
+	r128_mode = EBUR128_MODE_M;
+	for (k = 0; k < nr_series; ++k) {
+		r128_mode |= metric_info[series[k].metric].mode;
+	}
+	if (sinks[SINK_SUMMARY]) {
+		r128_mode |= EBUR128_MODE_I | EBUR128_MODE_LRA |
+		    EBUR128_MODE_SAMPLE_PEAK;
+	}
+	if (sinks[SINK_BINARY] && nr_files > 1 && !output_dir) {
+		fprintf(stderr, "Binary dumps of several files need "
+				"--output-dir\n");
 		return EXIT_FAILURE;
+	}
 
-	g_slist_foreach(files, (GFunc)dump_loudness_info, &ret);
-	if (st)
-		ebur128_destroy(&st);
+	next_to_print = 0;
+	print_file_names = nr_files > 1;
+	jobs = g_new0(struct dump_job, nr_files);
+	used_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    NULL);
+	pool = g_thread_pool_new((GFunc)dump_job_work_item, NULL, nproc(),
+	    FALSE, NULL);
+	for (i = 0; files; files = g_slist_next(files), ++i) {
+		init_dump_job(&jobs[i], files->data, i, used_names);
+		g_thread_pool_push(pool, &jobs[i], NULL);
+	}
+	for (i = 0; i < nr_files; ++i) {
+		g_mutex_lock(&dump_mutex);
+		while (!jobs[i].done) {
+			g_cond_wait(&dump_cond, &dump_mutex);
+		}
+		g_mutex_unlock(&dump_mutex);
+
+		if (jobs[i].error) {
+			ret = EXIT_FAILURE;
+		} else {
+			print_dump_job(&jobs[i]);
+		}
+		g_mutex_lock(&dump_mutex);
+		++next_to_print;
+		g_mutex_unlock(&dump_mutex);
+
+		if (jobs[i].spill) {
+			fclose(jobs[i].spill);
+		}
+		if (jobs[i].summary) {
+			g_string_free(jobs[i].summary, TRUE);
+		}
+		for (s = 0; s < DUMP_NR_SINKS; ++s) {
+			g_free(jobs[i].output_filename[s]);
+		}
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	g_hash_table_destroy(used_names);
+	g_free(jobs);
+	g_free(output_dir);
+	output_dir = NULL;
 
 	return ret;
 }
 
-gboolean
-loudness_dump_parse(int *argc, char **argv[])
+static gboolean
+add_series(enum dump_metric metric, double interval,
+    enum aggregate_mode mode)
 {
-	if (decode_to_file) {
-		fprintf(stderr, "Cannot decode to file in dump mode\n");
+	if (nr_series == MAX_SERIES) {
 		return FALSE;
 	}
+	series[nr_series].metric = metric;
+	series[nr_series].interval = interval;
+	series[nr_series].aggregate = mode;
+	++nr_series;
+	return TRUE;
+}
+
+/* "0.1,1,10,60": maximum momentary and short-term loudness at each of the
+ * intervals */
+static gboolean
+add_envelope_series(char const *levels)
+{
+	gchar **elements = g_strsplit(levels, ",", -1);
+	gboolean ret = elements[0] != NULL;
+	gchar **element;
+
+	for (element = elements; *element && ret; ++element) {
+		gchar *endptr;
+		double interval = g_ascii_strtod(*element, &endptr);
+		ret = endptr != *element && *endptr == '\0' &&
+		    interval >= AGGREGATE_STEP &&
+		    add_series(DUMP_MOMENTARY, interval, AGGREGATE_MAX) &&
+		    add_series(DUMP_SHORTTERM, interval, AGGREGATE_MAX);
+	}
+	g_strfreev(elements);
+	return ret;
+}
+
+/* "text,binary,summary,wav" */
+static gboolean
+parse_sinks(char const *list)
+{
+	gchar **elements = g_strsplit(list, ",", -1);
+	gboolean ret = elements[0] != NULL;
+	gchar **element;
+	int s;
+
+	for (element = elements; *element && ret; ++element) {
+		for (s = 0; s < DUMP_NR_SINKS; ++s) {
+			if (!strcmp(*element, sink_info[s].name)) {
+				sinks[s] = TRUE;
+				break;
+			}
+		}
+		ret = s < DUMP_NR_SINKS;
+	}
+	g_strfreev(elements);
+	return ret;
+}
+
+gboolean
+loudness_dump_parse(int *argc, char **argv[])
+{
+	gboolean given = FALSE;
+	gboolean needs_series;
+	int m;
 
 	if (!parse_mode_args(argc, argv, entries)) {
 		if (*argc == 1)
@@ -150,18 +1353,118 @@ loudness_dump_parse(int *argc, char **argv[])
 		return FALSE;
 	}
 
-	if ((momentary != 0.0) + (shortterm != 0.0) + (integrated != 0.0) !=
-		1 ||
-	    (interval = momentary + shortterm + integrated) <= 0.0) {
-		fprintf(stderr,
-		    "Exactly one of -m, -s and -i must be positive!\n");
+	for (m = 0; m < DUMP_NR_METRICS; ++m) {
+		if (intervals[m] < 0.0) {
+			break;
+		}
+		given |= intervals[m] > 0.0;
+	}
+	given |= envelope != NULL;
+
+	memset(sinks, '\0', sizeof sinks);
+	if (sinks_arg) {
+		if (binary) {
+			fprintf(stderr, "Use --sinks=binary instead of "
+					"--binary with --sinks\n");
+			return FALSE;
+		}
+		if (!parse_sinks(sinks_arg)) {
+			fprintf(stderr, "Invalid argument to --sinks!\n");
+			return FALSE;
+		}
+	} else {
+		sinks[binary ? SINK_BINARY : SINK_TEXT] = TRUE;
+	}
+	if (decode_to_file) {
+		sinks[SINK_WAV] = TRUE;
+	}
+	needs_series = sinks[SINK_TEXT] || sinks[SINK_BINARY];
+
+	if (from_binary) {
+		if (given || binary || sinks_arg || decode_to_file) {
+			fprintf(stderr, "--from-binary takes no other dump "
+					"options\n");
+			return FALSE;
+		}
+	} else if (m < DUMP_NR_METRICS || (needs_series && !given)) {
+		fprintf(stderr, "Intervals must be positive, and at least one "
+				"metric is needed!\n");
+		return FALSE;
+	}
+
+	g_free(sinks_arg);
+	sinks_arg = NULL;
+
+	if (!aggregate || !strcmp(aggregate, "last")) {
+		aggregate_mode = AGGREGATE_LAST;
+	} else if (!strcmp(aggregate, "max")) {
+		aggregate_mode = AGGREGATE_MAX;
+	} else if (!strcmp(aggregate, "mean")) {
+		aggregate_mode = AGGREGATE_MEAN;
+	} else if (!strcmp(aggregate, "gated")) {
+		aggregate_mode = AGGREGATE_GATED;
+	} else {
+		fprintf(stderr, "Invalid argument to --aggregate!\n");
+		return FALSE;
+	}
+	g_free(aggregate);
+	aggregate = NULL;
+	/* aggregated intervals are made of whole 100ms steps */
+	if (aggregate_mode != AGGREGATE_LAST &&
+	    ((intervals[DUMP_MOMENTARY] > 0.0 &&
+		 intervals[DUMP_MOMENTARY] < AGGREGATE_STEP) ||
+		(intervals[DUMP_SHORTTERM] > 0.0 &&
+		    intervals[DUMP_SHORTTERM] < AGGREGATE_STEP))) {
+		fprintf(stderr, "Aggregated intervals must be at least "
+				"0.1 seconds\n");
+		return FALSE;
+	}
+
+	nr_series = 0;
+	for (m = 0; m < DUMP_NR_METRICS; ++m) {
+		if (intervals[m] > 0.0) {
+			add_series(m, intervals[m],
+			    m == DUMP_MOMENTARY || m == DUMP_SHORTTERM ?
+				      aggregate_mode :
+				      AGGREGATE_LAST);
+		}
+	}
+	if (envelope && !add_envelope_series(envelope)) {
+		fprintf(stderr, "Invalid argument to --envelope!\n");
+		return FALSE;
+	}
+	g_free(envelope);
+	envelope = NULL;
+
+	if (output_dir && !g_file_test(output_dir, G_FILE_TEST_IS_DIR)) {
+		fprintf(stderr, "%s is not a directory\n", output_dir);
+		return FALSE;
+	}
+	if (!output_dir && sinks[SINK_BINARY] &&
+	    (sinks[SINK_TEXT] || sinks[SINK_SUMMARY])) {
+		fprintf(stderr, "A binary dump shares stdout with no other "
+				"sink, use --output-dir\n");
+		return FALSE;
+	}
+	if (sinks[SINK_WAV]) {
+#ifdef USE_SNDFILE
+		if (!output_dir && !decode_to_file) {
+			fprintf(stderr, "The wav sink needs --output-dir or "
+					"--decode\n");
+			return FALSE;
+		}
+#else
+		fprintf(stderr, "Decoding to WAV needs libsndfile\n");
 		return FALSE;
+#endif
 	}
 
-	if (momentary > 0.4 || shortterm > 3.0) {
+	if (aggregate_mode == AGGREGATE_LAST &&
+	    (intervals[DUMP_MOMENTARY] > 0.4 ||
+		intervals[DUMP_SHORTTERM] > 3.0)) {
 		fprintf(stderr,
 		    "Warning: you may lose samples when specifying "
-		    "this interval!\n");
+		    "this interval, see --aggregate!\n");
 	}
 	return TRUE;
 }
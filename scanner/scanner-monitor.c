@@ -0,0 +1,303 @@
+/* See COPYING file for copyright and license details. */
+
+#include "scanner-monitor.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_histogram.h"
+#include "parse_args.h"
+#include "scanner-common.h"
+
+extern gchar *decode_to_file;
+static double update_interval = 1.0;
+static double reset_interval = 0.0;
+static double window_length = 0.0;
+
+static GOptionEntry entries[] = {
+	{ "interval", 0, 0, G_OPTION_ARG_DOUBLE, &update_interval, NULL,
+	    NULL },
+	{ "reset", 0, 0, G_OPTION_ARG_DOUBLE, &reset_interval, NULL, NULL },
+	{ "window", 0, 0, G_OPTION_ARG_DOUBLE, &window_length, NULL, NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 },
+};
+
+/* Monitor mode never finishes a file. libebur128 only keeps the last 3s for
+ * the momentary and short-term loudness; the integrated loudness and the
+ * loudness range come from histograms of the 100ms momentary and short-term
+ * values (see block_histogram.h), so memory stays constant. With --window,
+ * the values of the last seconds are kept in a ring to be taken out of the
+ * histograms again; --reset clears the histograms periodically. */
+#define MONITOR_STEP 0.1
+
+struct value_ring {
+	double *values;
+	size_t size;
+	size_t start;
+	size_t len;
+};
+
+struct monitor {
+	guint32 *blocks;     /* momentary values, for the integrated loudness */
+	guint32 *shortterms; /* short-term values, for the loudness range */
+	struct value_ring block_ring;
+	struct value_ring shortterm_ring;
+	guint64 nr_steps;
+	double true_peak; /* since the last update */
+};
+
+static guint64
+get_boundary(double interval, guint64 n, unsigned long samplerate)
+{
+	return (guint64)((double)n * interval * (double)samplerate + 0.5);
+}
+
+static void
+ring_push(struct value_ring *ring, guint32 *histogram, double value)
+{
+	if (!ring->size) {
+		return;
+	}
+	if (ring->len == ring->size) {
+		block_histogram_remove(histogram, ring->values[ring->start]);
+		ring->start = (ring->start + 1) % ring->size;
+		--ring->len;
+	}
+	ring->values[(ring->start + ring->len) % ring->size] = value;
+	++ring->len;
+}
+
+/* The libebur128 state still holds the last 3s, so the blocks right after
+ * a reset are complete and nr_steps keeps counting. */
+static void
+reset_monitor(struct monitor *mon)
+{
+	memset(mon->blocks, '\0', BLOCK_HISTOGRAM_BINS * sizeof(guint32));
+	memset(mon->shortterms, '\0', BLOCK_HISTOGRAM_BINS * sizeof(guint32));
+	mon->block_ring.len = 0;
+	mon->shortterm_ring.len = 0;
+}
+
+/* called every 100ms of audio */
+static void
+add_step(ebur128_state *st, struct monitor *mon)
+{
+	double loudness;
+
+	++mon->nr_steps;
+	/* the first block is complete after four steps */
+	if (mon->nr_steps >= 4) {
+		ebur128_loudness_momentary(st, &loudness);
+		block_histogram_add(mon->blocks, loudness);
+		ring_push(&mon->block_ring, mon->blocks, loudness);
+	}
+	if (mon->nr_steps >= 30) {
+		ebur128_loudness_shortterm(st, &loudness);
+		block_histogram_add(mon->shortterms, loudness);
+		ring_push(&mon->shortterm_ring, mon->shortterms, loudness);
+	}
+}
+
+static void
+print_loudness(double loudness)
+{
+	if (loudness <= -HUGE_VAL) {
+		printf("  -inf");
+	} else {
+		printf(" %5.1f", loudness);
+	}
+}
+
+static void
+print_update(ebur128_state *st, struct monitor *mon, guint64 position)
+{
+	double loudness;
+
+	printf("%10.1f", (double)position / (double)st->samplerate);
+	ebur128_loudness_momentary(st, &loudness);
+	print_loudness(loudness);
+	ebur128_loudness_shortterm(st, &loudness);
+	print_loudness(loudness);
+	print_loudness(block_histogram_loudness(&mon->blocks, 1));
+	printf(" %5.1f", block_histogram_range(mon->shortterms));
+	print_loudness(mon->true_peak < DBL_MIN ?
+		      -HUGE_VAL :
+		      20.0 * log10(mon->true_peak));
+	putchar('\n');
+	/* updates go out as they happen, whatever stdout is */
+	fflush(stdout);
+	mon->true_peak = 0.0;
+}
+
+static void
+update_true_peak(ebur128_state *st, struct monitor *mon)
+{
+	unsigned i;
+
+	for (i = 0; i < st->channels; ++i) {
+		double peak;
+		ebur128_prev_true_peak(st, i, &peak);
+		if (peak > mon->true_peak) {
+			mon->true_peak = peak;
+		}
+	}
+}
+
+static void
+init_ring(struct value_ring *ring, double seconds)
+{
+	ring->size = (size_t)(seconds / MONITOR_STEP + 0.5);
+	ring->values = g_new(double, ring->size);
+	ring->start = 0;
+	ring->len = 0;
+}
+
+static int
+monitor_stream(struct filename_list_node *fln)
+{
+	struct input_ops *ops = NULL;
+	struct input_handle *ih = NULL;
+	ebur128_state *st = NULL;
+	float *buffer = NULL;
+	struct monitor mon;
+	int *channel_map;
+	guint64 position = 0;
+	guint64 nr_steps = 0, nr_updates = 0, nr_resets = 0;
+	guint64 next_step, next_update, next_reset = G_MAXUINT64;
+	unsigned i;
+
+	int result;
+	size_t nr_frames_read;
+
+	memset(&mon, '\0', sizeof mon);
+	result = open_plugin(fln->fr->raw, fln->fr->display, &ops, &ih);
+	if (result) {
+		goto free;
+	}
+
+	st = ebur128_init(ops->get_channels(ih), ops->get_samplerate(ih),
+	    EBUR128_MODE_S | EBUR128_MODE_TRUE_PEAK);
+	if (!st)
+		abort();
+
+	channel_map = g_new(int, st->channels);
+	if (!ops->set_channel_map(ih, channel_map)) {
+		for (i = 0; i < st->channels; ++i) {
+			ebur128_set_channel(st, i, channel_map[i]);
+		}
+	}
+	g_free(channel_map);
+
+	result = ops->allocate_buffer(ih);
+	if (result)
+		abort();
+	buffer = ops->get_buffer(ih);
+
+	mon.blocks = block_histogram_new();
+	mon.shortterms = block_histogram_new();
+	if (window_length > 0.0) {
+		init_ring(&mon.block_ring, window_length);
+		init_ring(&mon.shortterm_ring, window_length);
+	}
+	next_step = get_boundary(MONITOR_STEP, ++nr_steps, st->samplerate);
+	next_update = get_boundary(update_interval, ++nr_updates,
+	    st->samplerate);
+	if (reset_interval > 0.0) {
+		next_reset = get_boundary(reset_interval, ++nr_resets,
+		    st->samplerate);
+	}
+
+	fprintf(stderr, "   Seconds     M     S     I   LRA  dBTP\n");
+	while ((nr_frames_read = ops->read_frames(ih))) {
+		float *tmp_buffer = buffer;
+		while (nr_frames_read > 0) {
+			guint64 next = MIN(position + nr_frames_read,
+			    MIN(next_step, MIN(next_update, next_reset)));
+			size_t frames = (size_t)(next - position);
+
+			if (frames > 0) {
+				result = ebur128_add_frames_float(st,
+				    tmp_buffer, frames);
+				if (result)
+					abort();
+				update_true_peak(st, &mon);
+				tmp_buffer += frames * st->channels;
+				nr_frames_read -= frames;
+				position = next;
+			}
+			if (position == next_step) {
+				add_step(st, &mon);
+				next_step = get_boundary(MONITOR_STEP,
+				    ++nr_steps, st->samplerate);
+			}
+			if (position == next_update) {
+				print_update(st, &mon, position);
+				next_update = get_boundary(update_interval,
+				    ++nr_updates, st->samplerate);
+			}
+			if (position == next_reset) {
+				reset_monitor(&mon);
+				next_reset = get_boundary(reset_interval,
+				    ++nr_resets, st->samplerate);
+			}
+		}
+	}
+
+free:
+	g_free(mon.blocks);
+	g_free(mon.shortterms);
+	g_free(mon.block_ring.values);
+	g_free(mon.shortterm_ring.values);
+	if (st)
+		ebur128_destroy(&st);
+	if (ih)
+		ops->free_buffer(ih);
+	if (!result)
+		ops->close_file(ih);
+	if (ih)
+		ops->handle_destroy(&ih);
+	return result;
+}
+
+int
+loudness_monitor(GSList *files)
+{
+	if (g_slist_length(files) != 1) {
+		fprintf(stderr, "Monitor mode reads exactly one input\n");
+		return EXIT_FAILURE;
+	}
+	return monitor_stream(files->data) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+gboolean
+loudness_monitor_parse(int *argc, char **argv[])
+{
+	if (decode_to_file) {
+		fprintf(stderr, "Cannot decode to file in monitor mode\n");
+		return FALSE;
+	}
+	if (!parse_mode_args(argc, argv, entries)) {
+		if (*argc == 1)
+			fprintf(stderr, "Missing arguments\n");
+		return FALSE;
+	}
+	if (update_interval < MONITOR_STEP) {
+		fprintf(stderr, "The update interval must be at least %.1fs\n",
+		    MONITOR_STEP);
+		return FALSE;
+	}
+	if (reset_interval < 0.0 || window_length < 0.0 ||
+	    (reset_interval > 0.0 && window_length > 0.0)) {
+		fprintf(stderr, "Give either a positive --reset or a positive "
+				"--window\n");
+		return FALSE;
+	}
+	if (window_length > 0.0 && window_length < 3.0) {
+		fprintf(stderr, "The window must be at least 3s long\n");
+		return FALSE;
+	}
+	return TRUE;
+}
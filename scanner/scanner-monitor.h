@@ -0,0 +1,11 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef SCANNER_MONITOR_H
+#define SCANNER_MONITOR_H
+
+#include <glib.h>
+
+int loudness_monitor(GSList *files);
+gboolean loudness_monitor_parse(int *argc, char **argv[]);
+
+#endif /* end of include guard: SCANNER_MONITOR_H */
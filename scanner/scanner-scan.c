@@ -9,10 +9,14 @@
 
 #include <glib/gstdio.h>
 
+#include "block_histogram.h"
 #include "input.h"
 #include "nproc.h"
 #include "parse_args.h"
 #include "scanner-common.h"
+#ifdef USE_TAGLIB
+#include "scanner-tag.h"
+#endif
 
 
 static struct file_data empty;
@@ -20,13 +24,33 @@ static struct file_data empty;
 extern gboolean histogram;
 static gboolean lra = FALSE;
 static gchar *peak = NULL;
+static gint estimate = 0;
+static gdouble estimate_window = 3.0;
 extern gchar *decode_to_file;
+static gboolean segments = FALSE;
+static gboolean silence = FALSE;
+static gdouble silence_threshold = -60.0;
+#ifdef USE_TAGLIB
+static gboolean from_tags = FALSE;
+#endif
 
 static GOptionEntry entries[] = { { "lra", 'l', 0, G_OPTION_ARG_NONE, &lra,
 				      NULL, NULL },
 	{ "peak", 'p', 0, G_OPTION_ARG_STRING, &peak, NULL, NULL },
+	{ "estimate", 0, 0, G_OPTION_ARG_INT, &estimate, NULL, NULL },
+	{ "estimate-window", 0, 0, G_OPTION_ARG_DOUBLE, &estimate_window, NULL,
+	    NULL },
+	{ "segments", 0, 0, G_OPTION_ARG_NONE, &segments, NULL, NULL },
+	{ "silence", 0, 0, G_OPTION_ARG_NONE, &silence, NULL, NULL },
+	{ "silence-threshold", 0, 0, G_OPTION_ARG_DOUBLE, &silence_threshold,
+	    NULL, NULL },
+#ifdef USE_TAGLIB
+	{ "from-tags", 0, 0, G_OPTION_ARG_NONE, &from_tags, NULL, NULL },
+#endif
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 } };
 
+static void print_segment_data(struct file_data *fd);
+
 static void
 print_file_data(struct filename_list_node *fln, gpointer unused)
 {
@@ -39,6 +63,12 @@ print_file_data(struct filename_list_node *fln, gpointer unused)
 		} else {
 			g_print("%5.1f LUFS", fd->loudness);
 		}
+		if (estimate) {
+			if (fd->loudness_error >= HUGE_VAL)
+				g_print(", +/- inf LU");
+			else
+				g_print(", +/-%4.1f LU", fd->loudness_error);
+		}
 		if (lra)
 			g_print(", %4.1f LU", fd->lra);
 		if (peak) {
@@ -55,11 +85,109 @@ print_file_data(struct filename_list_node *fln, gpointer unused)
 						log(10.0));
 			}
 		}
+		/* only files have silence, not segments or the summary */
+		if (silence) {
+			if (fd->st) {
+				double rate = (double)fd->st->samplerate;
+				g_print(", %6.1f s, %6.1f s, %6.1f s at "
+					"%7.1f s",
+				    (double)fd->leading_silence / rate,
+				    (double)fd->trailing_silence / rate,
+				    (double)fd->longest_gap / rate,
+				    (double)fd->longest_gap_start / rate);
+			} else {
+				g_print("%43s", "");
+			}
+		}
 		if (fln->fr->display[0]) {
 			g_print(", ");
 			print_utf8_string(fln->fr->display);
 		}
 		putchar('\n');
+		print_segment_data(fd);
+	}
+}
+
+/* one line per segment below the line of the file */
+static void
+print_segment_data(struct file_data *fd)
+{
+	struct filename_list_node n;
+	struct filename_representations fr;
+	struct file_data result;
+	size_t i;
+
+	for (i = 0; i < fd->nr_segments; ++i) {
+		struct segment_data *segment = &fd->segments[i];
+
+		memcpy(&result, &empty, sizeof empty);
+		result.loudness = segment->loudness;
+		result.lra = segment->lra;
+		result.peak = segment->peak;
+		result.true_peak = segment->true_peak;
+		result.scanned = TRUE;
+		n.fr = &fr;
+		n.fr->display = segment_display_name(segment, i);
+		n.d = &result;
+		print_file_data(&n, NULL);
+		g_free(n.fr->display);
+	}
+}
+
+static void
+get_max_loudness_error(struct filename_list_node *fln, struct file_data *result)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	if (fd->scanned && fd->loudness_error > result->loudness_error) {
+		result->loudness_error = fd->loudness_error;
+	}
+}
+
+/* Results read from tags have no state.  Without block histograms for all
+ * files the collection loudness is estimated from the per-file loudness,
+ * weighting the energy of each file by its length. */
+static void
+add_weighted_energy(struct filename_list_node *fln, double *sums)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+	double length;
+
+	if (!fd->scanned || fd->loudness <= -HUGE_VAL) {
+		return;
+	}
+	length = fd->st ? (double)fd->number_of_elapsed_frames /
+		(double)fd->st->samplerate :
+			  fd->length;
+	sums[0] += length * pow(10.0, fd->loudness / 10.0);
+	sums[1] += length;
+}
+
+static void
+count_scanned(struct filename_list_node *fln, guint *nr_scanned)
+{
+	if (((struct file_data *)fln->d)->scanned) {
+		++*nr_scanned;
+	}
+}
+
+static void
+count_from_tags(struct filename_list_node *fln, guint *nr_from_tags)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	if (fd->scanned && !fd->st) {
+		++*nr_from_tags;
+	}
+}
+
+static void
+count_stored_histogram(struct filename_list_node *fln, guint *nr_histograms)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	if (fd && fd->block_histogram) {
+		++*nr_histograms;
 	}
 }
 
@@ -68,14 +196,38 @@ print_summary(GSList *files)
 {
 	int i;
 	GPtrArray *states = g_ptr_array_new();
+	GPtrArray *histograms = g_ptr_array_new();
+	guint nr_scanned = 0;
+	guint nr_from_tags = 0;
+	gboolean estimated = FALSE;
 	struct filename_list_node n;
 	struct filename_representations fr;
 	struct file_data result;
 	memcpy(&result, &empty, sizeof empty);
 
 	g_slist_foreach(files, (GFunc)get_state, states);
-	ebur128_loudness_global_multiple((ebur128_state **)states->pdata,
-	    states->len, &result.loudness);
+	g_slist_foreach(files, (GFunc)count_scanned, &nr_scanned);
+	g_slist_foreach(files, (GFunc)count_from_tags, &nr_from_tags);
+	/* a file scanned in estimate mode has a state per window */
+	if (nr_from_tags == 0) {
+		ebur128_loudness_global_multiple(
+		    (ebur128_state **)states->pdata, states->len,
+		    &result.loudness);
+	} else {
+		g_slist_foreach(files, (GFunc)get_block_histogram, histograms);
+		if (histograms->len == nr_scanned) {
+			result.loudness = block_histogram_loudness(
+			    (guint32 **)histograms->pdata, histograms->len);
+		} else {
+			double sums[2] = { 0.0, 0.0 };
+			g_slist_foreach(files, (GFunc)add_weighted_energy,
+			    sums);
+			result.loudness = sums[1] > 0.0 && sums[0] > 0.0 ?
+				  10.0 * log10(sums[0] / sums[1]) :
+				  -HUGE_VAL;
+			estimated = TRUE;
+		}
+	}
 	if (lra) {
 		ebur128_loudness_range_multiple((ebur128_state **)states->pdata,
 		    states->len, &result.lra);
@@ -83,6 +235,9 @@ print_summary(GSList *files)
 	if (peak) {
 		g_slist_foreach(files, (GFunc)get_max_peaks, &result);
 	}
+	if (estimate) {
+		g_slist_foreach(files, (GFunc)get_max_loudness_error, &result);
+	}
 
 	result.scanned = TRUE;
 	n.fr = &fr;
@@ -93,23 +248,53 @@ print_summary(GSList *files)
 	};
 	fputc('\n', stderr);
 	print_file_data(&n, NULL);
+	if (estimated) {
+		fprintf(stderr, "The collection loudness is estimated from the "
+				"track loudness, without gating\n");
+	}
 
 	g_ptr_array_free(states, TRUE);
+	g_ptr_array_free(histograms, TRUE);
 }
 
 void
 loudness_scan(GSList *files)
 {
-	struct scan_opts opts = { lra, peak, histogram, FALSE, decode_to_file };
+	struct scan_opts opts = { lra, peak, histogram, FALSE, decode_to_file,
+		estimate, estimate_window, FALSE, segments, silence,
+		silence_threshold, 0.0, NULL, NULL };
+	GSList *files_to_scan = files;
 	int do_scan = FALSE;
 
-	g_slist_foreach(files, (GFunc)init_and_get_number_of_frames, &do_scan);
+#ifdef USE_TAGLIB
+	if (from_tags) {
+		guint nr_files = g_slist_length(files);
+		guint nr_tagged;
+		guint nr_histograms = 0;
+
+		files_to_scan = read_results_from_tags(files, peak != NULL);
+		nr_tagged = nr_files - g_slist_length(files_to_scan);
+		do_scan = nr_tagged > 0;
+		/* histograms of decoded files keep the summary exact when the
+		 * tagged files have stored ones as well */
+		g_slist_foreach(files, (GFunc)count_stored_histogram,
+		    &nr_histograms);
+		opts.block_histogram = nr_tagged > 0 &&
+		    nr_histograms == nr_tagged;
+		fprintf(stderr, "%u of %u files read from tags\n", nr_tagged,
+		    nr_files);
+	}
+#endif
+	g_slist_foreach(files_to_scan, (GFunc)init_and_get_number_of_frames,
+	    &do_scan);
 	if (do_scan) {
 
-		process_files(files, &opts);
+		process_files(files_to_scan, &opts);
 
 		clear_line();
 		fprintf(stderr, "  Loudness");
+		if (estimate)
+			fprintf(stderr, ", Est. error");
 		if (lra)
 			fprintf(stderr, ",     LRA");
 		if (peak) {
@@ -120,12 +305,18 @@ loudness_scan(GSList *files)
 			if (!strcmp(peak, "dbtp") || !strcmp(peak, "all"))
 				fprintf(stderr, ",  True peak");
 		}
+		if (silence)
+			fprintf(stderr, ",  Leading, Trailing,"
+					"           Longest gap");
 		fprintf(stderr, "\n");
 
 		g_slist_foreach(files, (GFunc)print_file_data, NULL);
 		print_summary(files);
 	}
 	g_slist_foreach(files, (GFunc)destroy_state, NULL);
+	if (files_to_scan != files) {
+		g_slist_free(files_to_scan);
+	}
 	scanner_reset_common();
 
 	g_free(peak);
@@ -140,6 +331,31 @@ loudness_scan_parse(int *argc, char **argv[])
 		fprintf(stderr, "Invalid argument to --peak!\n");
 		return FALSE;
 	}
+	if (estimate && (estimate < 2 || estimate_window <= 0.0)) {
+		fprintf(stderr, "--estimate needs at least 2 windows of "
+				"positive length!\n");
+		return FALSE;
+	}
+	if (estimate && decode_to_file) {
+		fprintf(stderr, "Cannot decode to file in estimate mode\n");
+		return FALSE;
+	}
+	if (segments && estimate) {
+		fprintf(stderr, "Cannot measure segments in estimate mode\n");
+		return FALSE;
+	}
+	if (silence && estimate) {
+		fprintf(stderr, "Cannot find silence in estimate mode\n");
+		return FALSE;
+	}
+#ifdef USE_TAGLIB
+	if (from_tags && (segments || silence || lra || estimate ||
+			     decode_to_file || (peak && strcmp(peak, "sample")))) {
+		fprintf(stderr, "--from-tags only provides loudness and "
+				"sample peak\n");
+		return FALSE;
+	}
+#endif
 	if (!success) {
 		if (*argc == 1)
 			fprintf(stderr, "Missing arguments\n");
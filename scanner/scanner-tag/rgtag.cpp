@@ -3,14 +3,18 @@
 #include "rgtag.h"
 
 #include <apetag.h>
+#include <fileref.h>
+#include <id3v2synchdata.h>
 #include <id3v2tag.h>
 #include <relativevolumeframe.h>
 #include <taglib.h>
 #include <textidentificationframe.h>
+#include <tpropertymap.h>
 #include <xiphcomment.h>
 
 #include <flacfile.h>
 #include <mp4file.h>
+#include <mp4itemfactory.h>
 #include <mpcfile.h>
 #include <mpegfile.h>
 #include <oggfile.h>
@@ -25,6 +29,9 @@
 #include <iomanip>
 #include <ios>
 #include <sstream>
+#include <vector>
+
+#define BLOCK_HISTOGRAM_TAG "loudness_block_histogram"
 
 #ifdef _WIN32
 #define CAST_FILENAME (wchar_t const *)
@@ -127,6 +134,19 @@ set_rva2_tag(TagLib::ID3v2::Tag *tag, std::string const &tag_name, double gain,
 	rva2->setPeakVolume(peak_volume);
 }
 
+/* A tag block that keeps its size is patched in place, otherwise all data
+ * behind it has to be moved. Fills in the accounting and returns true if the
+ * write must be refused. */
+static bool
+refuse_write(TagWriteInfo *wi, long long old_size, long long new_size,
+    long long bytes_behind)
+{
+	wi->rewritten = new_size != old_size && bytes_behind > 0;
+	wi->bytes_written = static_cast<unsigned long long>(new_size) +
+	    (wi->rewritten ? static_cast<unsigned long long>(bytes_behind) : 0);
+	return wi->rewritten && wi->refuse_rewrite;
+}
+
 struct gain_data_strings {
 	gain_data_strings(struct gain_data *gd)
 	{
@@ -160,9 +180,10 @@ struct gain_data_strings {
 
 static int
 tag_id3v2(char const *filename, struct gain_data *gd,
-    struct gain_data_strings *gds)
+    struct gain_data_strings *gds, TagWriteInfo *wi)
 {
 	TagLib::MPEG::File f(CAST_FILENAME filename);
+	bool had_tag = f.hasID3v2Tag();
 	TagLib::ID3v2::Tag *id3v2tag = f.ID3v2Tag(true);
 	TagLib::uint version = id3v2tag->header()->majorVersion();
 	if (version > 4) {
@@ -200,17 +221,55 @@ tag_id3v2(char const *filename, struct gain_data *gd,
 			    gd->album_peak);
 		}
 	}
+	if (gd->block_histogram) {
+		set_txxx_tag(id3v2tag, BLOCK_HISTOGRAM_TAG,
+		    gd->block_histogram);
+	}
+
+	/* TagLib keeps the size of the tag if the frames fit into its
+	 * padding, and adds 1 KiB of padding otherwise */
+	TagLib::ID3v2::Version render_version = version <= 3 ?
+		  TagLib::ID3v2::Version::v3 :
+		  TagLib::ID3v2::Version::v4;
+	long long old_size = had_tag ? id3v2tag->header()->completeTagSize() :
+				       0;
+	TagLib::ByteVector data = id3v2tag->render(render_version);
+	if (refuse_write(wi, old_size, data.size(), f.length() - old_size)) {
+		return RG_NEEDS_REWRITE;
+	}
+
+	bool at_start = !had_tag;
+	if (had_tag) {
+		f.seek(0);
+		at_start = f.readBlock(3) == "ID3";
+	}
+	if (wi->rewritten && wi->padding && at_start &&
+	    !id3v2tag->header()->footerPresent()) {
+		/* The audio moves anyway, so reserve room for later updates. */
+		data.append(TagLib::ByteVector(
+		    static_cast<unsigned int>(wi->padding), '\0'));
+		TagLib::ByteVector size = TagLib::ID3v2::SynchData::fromUInt(
+		    data.size() - TagLib::ID3v2::Header::size());
+		for (unsigned int i = 0; i < 4; ++i) {
+			data[6 + i] = size[i];
+		}
+		f.insert(data, 0, static_cast<unsigned long>(old_size));
+		wi->bytes_written += wi->padding;
+		return 0;
+	}
+
 	return (int)!f.save(TagLib::MPEG::File::ID3v2,
-	    TagLib::File::StripTags::StripNone,
-	    version <= 3 ? TagLib::ID3v2::Version::v3 :
-				 TagLib::ID3v2::Version::v4);
+	    TagLib::File::StripTags::StripNone, render_version);
 }
 
 static bool
 has_tag_id3v2(char const *filename)
 {
-	TagLib::MPEG::File f(CAST_FILENAME filename);
-	TagLib::ID3v2::Tag *id3v2tag = f.ID3v2Tag(true);
+	TagLib::MPEG::File f(CAST_FILENAME filename, false);
+	TagLib::ID3v2::Tag *id3v2tag = f.ID3v2Tag();
+	if (!id3v2tag) {
+		return false;
+	}
 
 	bool has_tag = false;
 	float old_tag_value = 0;
@@ -247,28 +306,268 @@ has_tag_id3v2(char const *filename)
 	return has_tag;
 }
 
+static char *
+get_block_histogram_id3v2(char const *filename)
+{
+	TagLib::MPEG::File f(CAST_FILENAME filename, false);
+	TagLib::ID3v2::Tag *id3v2tag = f.ID3v2Tag();
+	if (!id3v2tag) {
+		return nullptr;
+	}
+	TagLib::ID3v2::UserTextIdentificationFrame *txxx =
+	    TagLib::ID3v2::UserTextIdentificationFrame::find(id3v2tag,
+		BLOCK_HISTOGRAM_TAG);
+	if (!txxx || txxx->fieldList().size() < 2) {
+		return nullptr;
+	}
+	/* the first field is the description */
+	return strdup(txxx->fieldList()[1].to8Bit().c_str());
+}
+
+/* Audio properties are only needed for writing; probes pass
+ * read_properties = false to parse nothing but the tags. */
 static std::pair<TagLib::File *, TagLib::Ogg::XiphComment *>
-get_ogg_file(char const *filename, char const *extension)
+get_ogg_file(char const *filename, char const *extension,
+    bool read_properties = true)
 {
 	TagLib::File *file = nullptr;
 	TagLib::Ogg::XiphComment *xiph = nullptr;
 	if (!std::strcmp(extension, "flac")) {
-		auto *f = new TagLib::FLAC::File(CAST_FILENAME filename);
+		auto *f = new TagLib::FLAC::File(CAST_FILENAME filename,
+		    read_properties);
 		xiph = f->xiphComment(true);
 		file = f;
 	} else if (!std::strcmp(extension, "ogg") ||
 	    !std::strcmp(extension, "oga")) {
-		auto *f = new TagLib::Ogg::Vorbis::File(CAST_FILENAME filename);
+		auto *f = new TagLib::Ogg::Vorbis::File(CAST_FILENAME filename,
+		    read_properties);
 		xiph = f->tag();
 		file = f;
 	} else if (!std::strcmp(extension, "opus")) {
-		auto *f = new TagLib::Ogg::Opus::File(CAST_FILENAME filename);
+		auto *f = new TagLib::Ogg::Opus::File(CAST_FILENAME filename,
+		    read_properties);
 		xiph = f->tag();
 		file = f;
 	}
 	return std::make_pair(file, xiph);
 }
 
+static TagLib::ByteVector
+flac_block_header(int type, unsigned int length, bool last)
+{
+	TagLib::ByteVector header = TagLib::ByteVector::fromUInt(length);
+	header[0] = static_cast<char>((last ? 0x80 : 0x00) | type);
+	return header;
+}
+
+/* Reads the metadata blocks of a FLAC file starting with "fLaC", except for
+ * the comment and padding blocks. *length is set to the length of all
+ * metadata including the marker. */
+static bool
+read_flac_blocks(TagLib::File *f, TagLib::ByteVector *blocks,
+    long long *length)
+{
+	bool last = false;
+
+	f->seek(0);
+	if (f->readBlock(4) != "fLaC") {
+		return false;
+	}
+	*length = 4;
+	while (!last) {
+		TagLib::ByteVector header = f->readBlock(4);
+		if (header.size() != 4) {
+			return false;
+		}
+		last = (header[0] & 0x80) != 0;
+		int type = header[0] & 0x7f;
+		unsigned int block_length = header.toUInt(1U, 3U);
+		if (type == 1 || type == 4) {
+			f->seek(block_length, TagLib::File::Current);
+		} else {
+			TagLib::ByteVector block = f->readBlock(block_length);
+			if (block.size() != block_length) {
+				return false;
+			}
+			header[0] = static_cast<char>(type);
+			blocks->append(header);
+			blocks->append(block);
+		}
+		*length += 4 + block_length;
+	}
+	return true;
+}
+
+/* Writes the FLAC metadata directly instead of through TagLib, so that
+ * the padding reserved on growth can be chosen. */
+static int
+save_flac(TagLib::File *f, TagLib::Ogg::XiphComment *xiph, TagWriteInfo *wi)
+{
+	TagLib::ByteVector blocks;
+	long long old_size;
+
+	if (!read_flac_blocks(f, &blocks, &old_size)) {
+		/* e.g. a leading ID3v2 tag, leave that to TagLib */
+		return (int)!f->save();
+	}
+
+	TagLib::ByteVector comment = xiph->render(false);
+	TagLib::ByteVector data("fLaC", 4);
+	data.append(blocks);
+	long long space = old_size - static_cast<long long>(data.size()) - 4 -
+	    static_cast<long long>(comment.size());
+	data.append(flac_block_header(4, comment.size(), space == 0));
+	data.append(comment);
+	if (space != 0) {
+		unsigned long padding = space >= 4 ?
+			  static_cast<unsigned long>(space - 4) :
+			  (wi->padding ? wi->padding : 4096);
+		padding = std::min(padding, 0xffffffUL);
+		data.append(flac_block_header(1,
+		    static_cast<unsigned int>(padding), true));
+		data.append(TagLib::ByteVector(
+		    static_cast<unsigned int>(padding), '\0'));
+	}
+
+	if (refuse_write(wi, old_size, data.size(), f->length() - old_size)) {
+		return RG_NEEDS_REWRITE;
+	}
+	f->insert(data, 0, static_cast<unsigned long>(old_size));
+	return 0;
+}
+
+struct ogg_page {
+	long long offset;
+	unsigned int header_size;
+	TagLib::ByteVector data;
+};
+
+static bool
+read_ogg_page(TagLib::File *f, long long offset, ogg_page *page)
+{
+	f->seek(offset);
+	TagLib::ByteVector header = f->readBlock(27);
+	if (header.size() != 27 || !header.startsWith("OggS")) {
+		return false;
+	}
+	unsigned int nr_segments = static_cast<unsigned char>(header[26]);
+	TagLib::ByteVector lacing = f->readBlock(nr_segments);
+	if (lacing.size() != nr_segments) {
+		return false;
+	}
+	unsigned int body_size = 0;
+	for (unsigned int i = 0; i < nr_segments; ++i) {
+		body_size += static_cast<unsigned char>(lacing[i]);
+	}
+	TagLib::ByteVector body = f->readBlock(body_size);
+	if (body.size() != body_size) {
+		return false;
+	}
+	page->offset = offset;
+	page->header_size = 27 + nr_segments;
+	page->data = header;
+	page->data.append(lacing);
+	page->data.append(body);
+	return true;
+}
+
+/* Replaces the body of a page, which must keep its size, and writes it
+ * with a new CRC. Returns the number of bytes written. */
+static unsigned int
+write_ogg_page(TagLib::File *f, ogg_page *page, TagLib::ByteVector const &body)
+{
+	TagLib::ByteVector data = page->data.mid(0, page->header_size);
+	data.append(body);
+	if (data == page->data) {
+		return 0;
+	}
+	for (unsigned int i = 22; i < 26; ++i) {
+		data[i] = '\0';
+	}
+	TagLib::ByteVector crc = TagLib::ByteVector::fromUInt(data.checksum(),
+	    false);
+	for (unsigned int i = 0; i < 4; ++i) {
+		data[22 + i] = crc[i];
+	}
+	f->seek(page->offset);
+	f->writeBlock(data);
+	page->data = data;
+	return data.size();
+}
+
+/* Patches the output gain in the OpusHead page and the OpusTags packet in
+ * place, recomputing the CRC of the changed pages only. This works if the
+ * new comment packet is not larger than the old one; the rest is filled
+ * with padding, which RFC 7845 allows after the comments. Returns false if
+ * the file has to be saved through TagLib. */
+static bool
+save_opus_in_place(TagLib::File *f, int16_t header_gain,
+    TagLib::Ogg::XiphComment *xiph, TagWriteInfo *wi)
+{
+	if (f->readOnly()) {
+		return false;
+	}
+
+	/* OpusHead is alone on the first page */
+	ogg_page head;
+	if (!read_ogg_page(f, 0, &head) ||
+	    head.data.size() < head.header_size + 19 ||
+	    head.data.mid(head.header_size, 8) != "OpusHead") {
+		return false;
+	}
+
+	/* OpusTags starts on the next page and ends a page */
+	std::vector<ogg_page> tags_pages;
+	long long offset = head.offset + head.data.size();
+	unsigned int packet_size = 0;
+	bool complete = false;
+	while (!complete) {
+		ogg_page page;
+		if (!read_ogg_page(f, offset, &page) ||
+		    page.data.mid(14, 4) != head.data.mid(14, 4)) {
+			return false;
+		}
+		unsigned int nr_segments = page.header_size - 27;
+		for (unsigned int i = 0; i < nr_segments; ++i) {
+			unsigned int lacing = /**/
+			    static_cast<unsigned char>(page.data[27 + i]);
+			packet_size += lacing;
+			if (lacing < 255) {
+				if (i != nr_segments - 1) {
+					return false;
+				}
+				complete = true;
+			}
+		}
+		offset += page.data.size();
+		tags_pages.push_back(page);
+	}
+
+	TagLib::ByteVector packet("OpusTags", 8);
+	packet.append(xiph->render(false));
+	if (packet.size() > packet_size) {
+		return false;
+	}
+	packet.resize(packet_size, '\0');
+
+	TagLib::ByteVector head_body = head.data.mid(head.header_size);
+	head_body[16] = static_cast<char>(
+	    static_cast<uint16_t>(header_gain) & 0xff);
+	head_body[17] = static_cast<char>(
+	    static_cast<uint16_t>(header_gain) >> 8);
+
+	wi->rewritten = false;
+	wi->bytes_written = write_ogg_page(f, &head, head_body);
+	unsigned int position = 0;
+	for (auto &page : tags_pages) {
+		unsigned int body_size = page.data.size() - page.header_size;
+		wi->bytes_written += write_ogg_page(f, &page,
+		    packet.mid(position, body_size));
+		position += body_size;
+	}
+	return true;
+}
+
 static int16_t
 to_opus_gain(double gain)
 {
@@ -324,7 +623,7 @@ clamp_gain_data(struct gain_data *gd)
 static int
 tag_vorbis_comment(char const *filename, char const *extension,
     struct gain_data *gd, struct gain_data_strings *gds,
-    OpusTagInfo const *opus_tag_info)
+    OpusTagInfo const *opus_tag_info, TagWriteInfo *wi)
 {
 	std::pair<TagLib::File *, TagLib::Ogg::XiphComment *> p =
 	    get_ogg_file(filename, extension);
@@ -332,6 +631,7 @@ tag_vorbis_comment(char const *filename, char const *extension,
 	bool is_opus = !std::strcmp(extension, "opus");
 	struct gain_data gd_opus;
 	struct gain_data_strings gds_opus(&gd_opus);
+	int16_t opus_header_gain_int = 0;
 
 	if (is_opus) {
 		double opus_header_gain;
@@ -348,7 +648,7 @@ tag_vorbis_comment(char const *filename, char const *extension,
 			opus_header_gain += opus_tag_info->offset;
 		}
 
-		int16_t opus_header_gain_int = to_opus_gain(opus_header_gain);
+		opus_header_gain_int = to_opus_gain(opus_header_gain);
 
 		{
 			auto *opus_file = /**/
@@ -403,10 +703,35 @@ tag_vorbis_comment(char const *filename, char const *extension,
 			p.second->removeFields("REPLAYGAIN_ALBUM_PEAK");
 		}
 	}
+	if (gd->block_histogram) {
+		p.second->addField(TagLib::String(BLOCK_HISTOGRAM_TAG).upper(),
+		    gd->block_histogram);
+	}
 
-	bool success = p.first->save();
+	int rc;
+	if (!std::strcmp(extension, "flac")) {
+		rc = save_flac(p.first, p.second, wi);
+	} else if (is_opus &&
+	    save_opus_in_place(p.first, opus_header_gain_int, p.second, wi)) {
+		rc = 0;
+	} else {
+		/* The Ogg pages of the comment packet are rewritten in place
+		 * only if the packet keeps its size. TagLib paginates the
+		 * packet itself, so no padding can be reserved here. */
+		auto *ogg_file = static_cast<TagLib::Ogg::File *>(p.first);
+		long long old_size = ogg_file->packet(1).size();
+		long long new_size = is_opus ?
+			  8 + p.second->render(false).size() :
+			  7 + p.second->render(true).size();
+		if (refuse_write(wi, old_size, new_size,
+			ogg_file->length() - old_size)) {
+			rc = RG_NEEDS_REWRITE;
+		} else {
+			rc = (int)!p.first->save();
+		}
+	}
 	delete p.first;
-	return (int)!success;
+	return rc;
 }
 
 static bool
@@ -414,7 +739,7 @@ has_vorbis_comment(char const *filename, char const *extension,
     bool opus_compat)
 {
 	std::pair<TagLib::File *, TagLib::Ogg::XiphComment *> p =
-	    get_ogg_file(filename, extension);
+	    get_ogg_file(filename, extension, false);
 
 	bool has_tag;
 	TagLib::uint fieldCount = p.second->fieldCount();
@@ -477,17 +802,37 @@ end:
 	return has_tag;
 }
 
+static char *
+get_block_histogram_vorbis_comment(char const *filename,
+    char const *extension)
+{
+	std::pair<TagLib::File *, TagLib::Ogg::XiphComment *> p =
+	    get_ogg_file(filename, extension, false);
+
+	char *ret = nullptr;
+	TagLib::Ogg::FieldListMap const &flm = p.second->fieldListMap();
+	TagLib::String key = TagLib::String(BLOCK_HISTOGRAM_TAG).upper();
+	if (flm.contains(key) && !flm[key].isEmpty()) {
+		ret = strdup(flm[key].front().to8Bit().c_str());
+	}
+	delete p.first;
+	return ret;
+}
+
 static std::pair<TagLib::File *, TagLib::APE::Tag *>
-get_ape_file(char const *filename, char const *extension)
+get_ape_file(char const *filename, char const *extension,
+    bool read_properties = true)
 {
 	TagLib::File *file = nullptr;
 	TagLib::APE::Tag *ape = nullptr;
 	if (!std::strcmp(extension, "mpc")) {
-		auto *f = new TagLib::MPC::File(CAST_FILENAME filename);
+		auto *f = new TagLib::MPC::File(CAST_FILENAME filename,
+		    read_properties);
 		ape = f->APETag(true);
 		file = f;
 	} else if (!std::strcmp(extension, "wv")) {
-		auto *f = new TagLib::WavPack::File(CAST_FILENAME filename);
+		auto *f = new TagLib::WavPack::File(CAST_FILENAME filename,
+		    read_properties);
 		ape = f->APETag(true);
 		file = f;
 	}
@@ -496,7 +841,7 @@ get_ape_file(char const *filename, char const *extension)
 
 static int
 tag_ape(char const *filename, char const *extension, struct gain_data *gd,
-    struct gain_data_strings *gds)
+    struct gain_data_strings *gds, TagWriteInfo *wi)
 {
 	std::pair<TagLib::File *, TagLib::APE::Tag *> p = get_ape_file(filename,
 	    extension);
@@ -509,6 +854,11 @@ tag_ape(char const *filename, char const *extension, struct gain_data *gd,
 		p.second->removeItem("replaygain_album_gain");
 		p.second->removeItem("replaygain_album_peak");
 	}
+	if (gd->block_histogram) {
+		p.second->addValue(BLOCK_HISTOGRAM_TAG, gd->block_histogram);
+	}
+	/* the APE tag sits at the end, nothing but an ID3v1 tag moves */
+	refuse_write(wi, 0, p.second->render().size(), 0);
 	bool success = p.first->save();
 	delete p.first;
 	return (int)!success;
@@ -518,7 +868,7 @@ static bool
 has_tag_ape(char const *filename, char const *extension)
 {
 	std::pair<TagLib::File *, TagLib::APE::Tag *> p = get_ape_file(filename,
-	    extension);
+	    extension, false);
 
 	TagLib::uint fieldCount = p.second->itemListMap().size();
 
@@ -532,15 +882,139 @@ has_tag_ape(char const *filename, char const *extension)
 	return has_tag;
 }
 
+static char *
+get_block_histogram_ape(char const *filename, char const *extension)
+{
+	std::pair<TagLib::File *, TagLib::APE::Tag *> p = get_ape_file(filename,
+	    extension, false);
+
+	char *ret = nullptr;
+	/* APE item keys are case-insensitive and stored upper case */
+	TagLib::APE::ItemListMap const &ilm = p.second->itemListMap();
+	TagLib::String key = TagLib::String(BLOCK_HISTOGRAM_TAG).upper();
+	if (ilm.contains(key)) {
+		ret = strdup(ilm[key].toString().to8Bit().c_str());
+	}
+	delete p.first;
+	return ret;
+}
+
+struct mp4_atom {
+	long long offset;
+	long long length;
+	TagLib::ByteVector name;
+};
+
+static bool
+read_mp4_atom(TagLib::File *f, long long offset, long long end,
+    mp4_atom *atom)
+{
+	if (offset + 8 > end) {
+		return false;
+	}
+	f->seek(offset);
+	TagLib::ByteVector header = f->readBlock(8);
+	if (header.size() != 8) {
+		return false;
+	}
+	atom->offset = offset;
+	atom->length = header.toUInt(0U, 4U);
+	atom->name = header.mid(4, 4);
+	if (atom->length == 1) {
+		TagLib::ByteVector length = f->readBlock(8);
+		if (length.size() != 8) {
+			return false;
+		}
+		atom->length = length.toLongLong();
+	} else if (atom->length == 0) {
+		atom->length = end - offset;
+	}
+	return atom->length >= 8 && offset + atom->length <= end;
+}
+
+static bool
+find_mp4_atom(TagLib::File *f, long long offset, long long end,
+    char const *name, mp4_atom *atom, mp4_atom *previous = nullptr)
+{
+	mp4_atom prev = { 0, 0, TagLib::ByteVector() };
+	while (read_mp4_atom(f, offset, end, atom)) {
+		if (atom->name == name) {
+			if (previous) {
+				*previous = prev;
+			}
+			return true;
+		}
+		prev = *atom;
+		offset += atom->length;
+	}
+	return false;
+}
+
+/* Gets the space TagLib can use for 'ilst' without growing 'moov' (the
+ * atom itself and 'free' atoms next to it), and the end of 'moov'. */
+static bool
+get_mp4_ilst_space(TagLib::File *f, long long *ilst_length, long long *space,
+    long long *moov_end)
+{
+	mp4_atom moov, udta, meta, ilst, prev, next;
+	if (!find_mp4_atom(f, 0, f->length(), "moov", &moov)) {
+		return false;
+	}
+	*moov_end = moov.offset + moov.length;
+	if (!find_mp4_atom(f, moov.offset + 8, *moov_end, "udta", &udta) ||
+	    !find_mp4_atom(f, udta.offset + 8, udta.offset + udta.length,
+		"meta", &meta) ||
+	    !find_mp4_atom(f, meta.offset + 12, meta.offset + meta.length,
+		"ilst", &ilst, &prev)) {
+		*ilst_length = *space = 0;
+		return true;
+	}
+	*ilst_length = *space = ilst.length;
+	if (prev.name == "free") {
+		*space += prev.length;
+	}
+	if (read_mp4_atom(f, ilst.offset + ilst.length,
+		meta.offset + meta.length, &next) &&
+	    next.name == "free") {
+		*space += next.length;
+	}
+	return true;
+}
+
+/* size of a freeform item as rendered by TagLib */
+static long long
+mp4_item_size(TagLib::MP4::Tag *t, char const *name)
+{
+	TagLib::String key = TagLib::String("----:com.apple.iTunes:") + name;
+	TagLib::MP4::ItemMap const &ilm = t->itemMap();
+	if (!ilm.contains(key)) {
+		return 0;
+	}
+	return TagLib::MP4::ItemFactory::instance()
+	    ->renderItem(key, ilm[key])
+	    .size();
+}
+
+static long long
+mp4_rg_items_size(TagLib::MP4::Tag *t)
+{
+	return mp4_item_size(t, "replaygain_track_gain") +
+	    mp4_item_size(t, "replaygain_track_peak") +
+	    mp4_item_size(t, "replaygain_album_gain") +
+	    mp4_item_size(t, "replaygain_album_peak") +
+	    mp4_item_size(t, BLOCK_HISTOGRAM_TAG);
+}
+
 static int
 tag_mp4(char const *filename, struct gain_data *gd,
-    struct gain_data_strings *gds)
+    struct gain_data_strings *gds, TagWriteInfo *wi)
 {
 	TagLib::MP4::File f(CAST_FILENAME filename);
 	TagLib::MP4::Tag *t = f.tag();
 	if (!t) {
 		return 1;
 	}
+	long long items_size = mp4_rg_items_size(t);
 	t->setItem("----:com.apple.iTunes:replaygain_track_gain",
 	    TagLib::StringList(gds->track_gain));
 	t->setItem("----:com.apple.iTunes:replaygain_track_peak",
@@ -554,13 +1028,36 @@ tag_mp4(char const *filename, struct gain_data *gd,
 		t->removeItem("----:com.apple.iTunes:replaygain_album_gain");
 		t->removeItem("----:com.apple.iTunes:replaygain_album_peak");
 	}
+	if (gd->block_histogram) {
+		t->setItem("----:com.apple.iTunes:" BLOCK_HISTOGRAM_TAG,
+		    TagLib::StringList(gd->block_histogram));
+	}
+
+	/* TagLib fills up the space with a 'free' atom if it is either a
+	 * perfect fit or leaves room for the 8 byte atom header. Only the
+	 * media data behind 'moov' counts as rewritten. */
+	long long ilst_length, space, moov_end;
+	if (get_mp4_ilst_space(&f, &ilst_length, &space, &moov_end)) {
+		long long new_size = ilst_length - items_size +
+		    mp4_rg_items_size(t);
+		if (!ilst_length) {
+			/* 'udta', 'meta' and 'ilst' have to be created */
+			new_size += 8 + 12 + 8 + 8;
+		}
+		if (new_size == space || new_size <= space - 8) {
+			new_size = space;
+		}
+		if (refuse_write(wi, space, new_size, f.length() - moov_end)) {
+			return RG_NEEDS_REWRITE;
+		}
+	}
 	return (int)!f.save();
 }
 
 static bool
 has_tag_mp4(char const *filename)
 {
-	TagLib::MP4::File f(CAST_FILENAME filename);
+	TagLib::MP4::File f(CAST_FILENAME filename, false);
 	TagLib::MP4::Tag *t = f.tag();
 	if (!t) {
 		std::cerr << "Error reading mp4 tag" << std::endl;
@@ -600,10 +1097,33 @@ has_tag_mp4(char const *filename)
 	return has_tag;
 }
 
+static char *
+get_block_histogram_mp4(char const *filename)
+{
+	TagLib::MP4::File f(CAST_FILENAME filename, false);
+	TagLib::MP4::Tag *t = f.tag();
+	if (!t) {
+		return nullptr;
+	}
+	TagLib::MP4::ItemMap const &ilm = t->itemMap();
+	TagLib::String key = "----:com.apple.iTunes:" BLOCK_HISTOGRAM_TAG;
+	if (!ilm.contains(key) || ilm[key].toStringList().isEmpty()) {
+		return nullptr;
+	}
+	return strdup(ilm[key].toStringList().front().to8Bit().c_str());
+}
+
 int
 set_rg_info(char const *filename, char const *extension, struct gain_data *gd,
-    OpusTagInfo const *opus_tag_info)
+    OpusTagInfo const *opus_tag_info, TagWriteInfo *write_info)
 {
+	TagWriteInfo default_write_info = { 0, false, 0, false };
+	if (!write_info) {
+		write_info = &default_write_info;
+	}
+	write_info->bytes_written = 0;
+	write_info->rewritten = false;
+
 	if (std::strcmp(extension, "opus") != 0) {
 		/* For opus, we clamp in tag_vorbis_comment(). */
 		clamp_gain_data(gd);
@@ -612,7 +1132,7 @@ set_rg_info(char const *filename, char const *extension, struct gain_data *gd,
 	struct gain_data_strings gds(gd);
 
 	if (!std::strcmp(extension, "mp3") || !std::strcmp(extension, "mp2")) {
-		return tag_id3v2(filename, gd, &gds);
+		return tag_id3v2(filename, gd, &gds, write_info);
 	}
 
 	if (!std::strcmp(extension, "flac") ||
@@ -620,15 +1140,15 @@ set_rg_info(char const *filename, char const *extension, struct gain_data *gd,
 	    !std::strcmp(extension, "ogg") ||  /**/
 	    !std::strcmp(extension, "oga")) {
 		return tag_vorbis_comment(filename, extension, gd, &gds,
-		    opus_tag_info);
+		    opus_tag_info, write_info);
 	}
 
 	if (!std::strcmp(extension, "mpc") || !std::strcmp(extension, "wv")) {
-		return tag_ape(filename, extension, gd, &gds);
+		return tag_ape(filename, extension, gd, &gds, write_info);
 	}
 
 	if (!std::strcmp(extension, "mp4") || !std::strcmp(extension, "m4a")) {
-		return tag_mp4(filename, gd, &gds);
+		return tag_mp4(filename, gd, &gds, write_info);
 	}
 
 	return 1;
@@ -661,3 +1181,208 @@ has_rg_info(char const *filename, char const *extension,
 
 	return false;
 }
+
+char *
+get_block_histogram_tag(char const *filename, char const *extension)
+{
+	if (!std::strcmp(extension, "mp3") || !std::strcmp(extension, "mp2")) {
+		return get_block_histogram_id3v2(filename);
+	}
+
+	if (!std::strcmp(extension, "flac") ||
+	    !std::strcmp(extension, "opus") || /**/
+	    !std::strcmp(extension, "ogg") ||  /**/
+	    !std::strcmp(extension, "oga")) {
+		return get_block_histogram_vorbis_comment(filename, extension);
+	}
+
+	if (!std::strcmp(extension, "mpc") || !std::strcmp(extension, "wv")) {
+		return get_block_histogram_ape(filename, extension);
+	}
+
+	if (!std::strcmp(extension, "mp4") || !std::strcmp(extension, "m4a")) {
+		return get_block_histogram_mp4(filename);
+	}
+
+	return nullptr;
+}
+
+double
+get_audio_length(char const *filename)
+{
+	TagLib::FileRef f(CAST_FILENAME filename, true,
+	    TagLib::AudioProperties::Fast);
+	if (f.isNull() || !f.audioProperties()) {
+		return 0.0;
+	}
+	return f.audioProperties()->lengthInMilliseconds() / 1000.0;
+}
+
+char *
+get_album_tags(char const *filename)
+{
+	TagLib::FileRef f(CAST_FILENAME filename, false);
+	if (f.isNull() || !f.tag() || f.tag()->album().isEmpty()) {
+		return nullptr;
+	}
+	TagLib::PropertyMap properties = f.file()->properties();
+	TagLib::String album_artist;
+	if (properties.contains("ALBUMARTIST") &&
+	    !properties["ALBUMARTIST"].isEmpty()) {
+		album_artist = properties["ALBUMARTIST"].front();
+	}
+	std::string key = album_artist.to8Bit(true) + "\n" +
+	    f.tag()->album().to8Bit(true);
+	return strdup(key.c_str());
+}
+
+/* Stored values as read from the tags, all in ReplayGain terms */
+struct rg_values {
+	double track_gain = NAN;
+	double track_peak = NAN;
+	double album_gain = NAN;
+	double album_peak = NAN;
+
+	bool
+	set(TagLib::String const &key, TagLib::String const &value)
+	{
+		TagLib::String k = key.upper();
+		double v = parse_string_to_float(value.to8Bit());
+		if (k == "REPLAYGAIN_TRACK_GAIN") {
+			track_gain = v;
+		} else if (k == "REPLAYGAIN_TRACK_PEAK") {
+			track_peak = v;
+		} else if (k == "REPLAYGAIN_ALBUM_GAIN") {
+			album_gain = v;
+		} else if (k == "REPLAYGAIN_ALBUM_PEAK") {
+			album_peak = v;
+		} else {
+			return false;
+		}
+		return true;
+	}
+};
+
+static void
+get_values_id3v2(char const *filename, rg_values *values)
+{
+	TagLib::MPEG::File f(CAST_FILENAME filename, false);
+	TagLib::ID3v2::Tag *id3v2tag = f.ID3v2Tag();
+	if (!id3v2tag) {
+		return;
+	}
+	for (auto *it : id3v2tag->frameList("TXXX")) {
+		auto *fr = dynamic_cast</**/
+		    TagLib::ID3v2::UserTextIdentificationFrame *>(it);
+		if (fr && fr->fieldList().size() >= 2) {
+			values->set(fr->description(), fr->fieldList()[1]);
+		}
+	}
+}
+
+static void
+get_values_vorbis_comment(char const *filename, char const *extension,
+    rg_values *values)
+{
+	std::pair<TagLib::File *, TagLib::Ogg::XiphComment *> p =
+	    get_ogg_file(filename, extension, false);
+
+	TagLib::Ogg::FieldListMap const &flm = p.second->fieldListMap();
+	for (auto const &i : flm) {
+		if (!i.second.isEmpty()) {
+			values->set(i.first, i.second.front());
+		}
+	}
+
+	/* R128 gains are relative to -23 LUFS and to the header gain */
+	if (!std::strcmp(extension, "opus")) {
+		auto *opus_file = static_cast<TagLib::Ogg::Opus::File *>(p.first);
+		TagLib::ByteVector header = opus_file->packet(0);
+		double header_gain = 0.0;
+		if (header.size() >= 18) {
+			header_gain = static_cast<int16_t>(
+					  header.toUShort(16U, false)) /
+			    256.0;
+		}
+		if (flm.contains("R128_TRACK_GAIN") &&
+		    !flm["R128_TRACK_GAIN"].isEmpty()) {
+			values->track_gain = flm["R128_TRACK_GAIN"].front().toInt() /
+				256.0 +
+			    header_gain + 5.0;
+		}
+		if (flm.contains("R128_ALBUM_GAIN") &&
+		    !flm["R128_ALBUM_GAIN"].isEmpty()) {
+			values->album_gain = flm["R128_ALBUM_GAIN"].front().toInt() /
+				256.0 +
+			    header_gain + 5.0;
+		}
+		/* REPLAYGAIN_*_PEAK are relative to the header gain as well */
+		double factor = std::pow(10.0, header_gain / 20.0);
+		values->track_peak /= factor;
+		values->album_peak /= factor;
+	}
+	delete p.first;
+}
+
+static void
+get_values_ape(char const *filename, char const *extension,
+    rg_values *values)
+{
+	std::pair<TagLib::File *, TagLib::APE::Tag *> p = get_ape_file(filename,
+	    extension, false);
+
+	for (auto const &i : p.second->itemListMap()) {
+		values->set(i.first, i.second.toString());
+	}
+	delete p.first;
+}
+
+static void
+get_values_mp4(char const *filename, rg_values *values)
+{
+	TagLib::MP4::File f(CAST_FILENAME filename, false);
+	TagLib::MP4::Tag *t = f.tag();
+	if (!t) {
+		return;
+	}
+	for (auto const &i : t->itemMap()) {
+		TagLib::String key = i.first;
+		if (!key.startsWith("----:com.apple.iTunes:")) {
+			continue;
+		}
+		TagLib::StringList const &sl = i.second.toStringList();
+		if (!sl.isEmpty()) {
+			values->set(key.substr(22), sl.front());
+		}
+	}
+}
+
+bool
+get_rg_info(char const *filename, char const *extension,
+    struct gain_data *gd)
+{
+	rg_values values;
+
+	if (!std::strcmp(extension, "mp3") || !std::strcmp(extension, "mp2")) {
+		get_values_id3v2(filename, &values);
+	} else if (!std::strcmp(extension, "flac") ||
+	    !std::strcmp(extension, "opus") || /**/
+	    !std::strcmp(extension, "ogg") ||  /**/
+	    !std::strcmp(extension, "oga")) {
+		get_values_vorbis_comment(filename, extension, &values);
+	} else if (!std::strcmp(extension, "mpc") ||
+	    !std::strcmp(extension, "wv")) {
+		get_values_ape(filename, extension, &values);
+	} else if (!std::strcmp(extension, "mp4") ||
+	    !std::strcmp(extension, "m4a")) {
+		get_values_mp4(filename, &values);
+	}
+
+	gd->track_gain = values.track_gain;
+	gd->track_peak = values.track_peak;
+	gd->album_mode = !std::isnan(values.album_gain);
+	gd->album_gain = values.album_gain;
+	gd->album_peak = values.album_peak;
+	gd->block_histogram = nullptr;
+	return !std::isnan(values.track_gain);
+}
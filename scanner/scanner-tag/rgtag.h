@@ -15,6 +15,8 @@ struct gain_data {
 	int album_mode;
 	double album_gain;
 	double album_peak;
+	/* if non-NULL, stored in a private tag (see block_histogram.h) */
+	char const *block_histogram;
 };
 
 typedef enum {
@@ -29,15 +31,49 @@ typedef struct {
 	bool is_track;
 } OpusTagInfo;
 
+typedef struct {
+	/* padding in bytes to reserve when an ID3v2 tag or FLAC metadata has
+	 * to grow, 0 for the default */
+	unsigned long padding;
+	/* fail with RG_NEEDS_REWRITE instead of moving the audio data */
+	bool refuse_rewrite;
+
+	/* set by set_rg_info(): bytes written, and whether the audio data
+	 * behind the tags had to be moved because they didn't fit */
+	unsigned long long bytes_written;
+	bool rewritten;
+} TagWriteInfo;
+
+/* returned by set_rg_info() if TagWriteInfo.refuse_rewrite is set and the
+ * tags don't fit in place */
+#define RG_NEEDS_REWRITE 2
+
 double clamp_rg(double x);
 void clamp_gain_data(struct gain_data *gd);
 
 int set_rg_info(char const *filename, char const *extension,
-    struct gain_data *gd, OpusTagInfo const *opus_tag_info);
+    struct gain_data *gd, OpusTagInfo const *opus_tag_info,
+    TagWriteInfo *write_info);
 
 bool has_rg_info(char const *filename, char const *extension,
     OpusTagInfo const *opus_tag_info);
 
+/* Reads the stored ReplayGain values into gd, as they would be passed to
+ * set_rg_info(). Missing peaks are set to NAN; album_mode is set if there is
+ * an album gain. Returns false if there is no track gain. */
+bool get_rg_info(char const *filename, char const *extension,
+    struct gain_data *gd);
+
+/* Returns the stored block histogram, to be freed with free(), or NULL. */
+char *get_block_histogram_tag(char const *filename, char const *extension);
+
+/* Returns the length of the audio in seconds, or 0 if unknown. */
+double get_audio_length(char const *filename);
+
+/* Returns "ALBUMARTIST\nALBUM", to be freed with free(), or NULL if the file
+ * has no album tag. */
+char *get_album_tags(char const *filename);
+
 #ifdef __cplusplus
 }
 #endif
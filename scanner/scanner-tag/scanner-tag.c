@@ -2,11 +2,21 @@
 
 #include "scanner-tag.h"
 
+#include <fcntl.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <glib/gstdio.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "block_histogram.h"
 #include "nproc.h"
 #include "parse_args.h"
 #include "rgtag.h"
@@ -21,6 +31,15 @@ static gboolean track = FALSE;
 static gboolean dry_run = FALSE;
 static gboolean incremental_tagging = FALSE;
 static gboolean force_as_album = FALSE;
+static gint tag_threads = 0;
+static gboolean store_histograms = FALSE;
+static gint tag_padding = 0;
+static gboolean no_rewrite = FALSE;
+static gboolean album_from_tags = FALSE;
+static gchar *journal_file = NULL;
+static gboolean segments = FALSE;
+static gdouble verify_tolerance = 0.1;
+static gboolean verify_use_histograms = FALSE;
 
 static gboolean opus_vorbisgain_compat = FALSE;
 static OpusTagInfo opus_tag_info = {
@@ -120,6 +139,20 @@ static GOptionEntry entries[] = {
 	    &incremental_tagging, NULL, NULL },
 	{ "force-as-album", 0, 0, G_OPTION_ARG_NONE, /**/
 	    &force_as_album, NULL, NULL },
+	{ "album-from-tags", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &album_from_tags, NULL, NULL },
+	{ "tag-threads", 0, 0, G_OPTION_ARG_INT, /**/
+	    &tag_threads, NULL, NULL },
+	{ "store-histograms", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &store_histograms, NULL, NULL },
+	{ "tag-padding", 0, 0, G_OPTION_ARG_INT, /**/
+	    &tag_padding, NULL, NULL },
+	{ "no-rewrite", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &no_rewrite, NULL, NULL },
+	{ "journal", 0, 0, G_OPTION_ARG_FILENAME, /**/
+	    &journal_file, NULL, NULL },
+	{ "segments", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &segments, NULL, NULL },
 	{ "opus-vorbisgain-compat", 0, 0, G_OPTION_ARG_NONE, /**/
 	    &opus_vorbisgain_compat, NULL, NULL },
 	{ "opus-header-gain", 0, 0, G_OPTION_ARG_CALLBACK, /**/
@@ -127,6 +160,22 @@ static GOptionEntry entries[] = {
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 },
 };
 
+static GOptionEntry verify_entries[] = {
+	{ "track", 't', 0, G_OPTION_ARG_NONE, /**/
+	    &track, NULL, NULL },
+	{ "force-as-album", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &force_as_album, NULL, NULL },
+	{ "album-from-tags", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &album_from_tags, NULL, NULL },
+	{ "tag-threads", 0, 0, G_OPTION_ARG_INT, /**/
+	    &tag_threads, NULL, NULL },
+	{ "tolerance", 0, 0, G_OPTION_ARG_DOUBLE, /**/
+	    &verify_tolerance, NULL, NULL },
+	{ "use-histograms", 0, 0, G_OPTION_ARG_NONE, /**/
+	    &verify_use_histograms, NULL, NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 },
+};
+
 static void
 fill_album_data(struct filename_list_node *fln, double const *album_data)
 {
@@ -136,74 +185,190 @@ fill_album_data(struct filename_list_node *fln, double const *album_data)
 	fd->peak_album = album_data[1];
 }
 
-static gchar *current_dir;
-static GSList *files_in_current_dir;
+/* must g_free basename and filename */
+static void
+get_filename_and_extension(struct filename_list_node *fln, char **basename,
+    char **extension, char **filename)
+{
+	*basename = g_path_get_basename(fln->fr->raw);
+	*extension = strrchr(*basename, '.');
+	if (*extension) {
+		++*extension;
+	} else {
+		*extension = "";
+	}
+#ifdef G_OS_WIN32
+	*filename = (char *)g_utf8_to_utf16(fln->fr->raw, -1, NULL, NULL, NULL);
+#else
+	*filename = g_strdup(fln->fr->raw);
+#endif
+}
+
+static gchar *
+read_album_key(struct filename_list_node *fln)
+{
+	gchar *key = NULL;
+	gchar *dirname;
+
+	if (force_as_album) {
+		return g_strdup("");
+	}
+	if (album_from_tags) {
+		char *basename;
+		char *extension;
+		char *filename;
+		char *tags;
+		get_filename_and_extension(fln, &basename, &extension,
+		    &filename);
+		tags = get_album_tags(filename);
+		if (tags) {
+			key = g_strconcat("tags:", tags, NULL);
+			free(tags);
+		}
+		g_free(basename);
+		g_free(filename);
+	}
+	if (!key) {
+		dirname = g_path_get_dirname(fln->fr->raw);
+		key = g_strconcat("dir:", dirname, NULL);
+		g_free(dirname);
+	}
+	return key;
+}
 
 static void
-calculate_album_gain_and_peak_last_dir(void)
+album_key_job_work_item(struct filename_list_node *fln, gpointer unused)
 {
-	double album_data[] = { 0.0, 0.0 };
-	GPtrArray *states = g_ptr_array_new();
-	struct file_data result;
-	memcpy(&result, &empty, sizeof empty);
+	struct file_data *fd;
 
-	files_in_current_dir = g_slist_reverse(files_in_current_dir);
-	g_slist_foreach(files_in_current_dir, (GFunc)get_state, states);
-	ebur128_loudness_global_multiple((ebur128_state **)states->pdata,
-	    states->len, &album_data[0]);
-	album_data[0] = RG_REFERENCE_LEVEL - album_data[0];
-	g_slist_foreach(files_in_current_dir, (GFunc)get_max_peaks, &result);
-	album_data[1] = result.peak;
-	g_slist_foreach(files_in_current_dir, (GFunc)fill_album_data,
-	    album_data);
+	(void)unused;
+	fln->d = g_malloc(sizeof(struct file_data));
+	memcpy(fln->d, &empty, sizeof empty);
+	fd = (struct file_data *)fln->d;
+	fd->album_key = read_album_key(fln);
+}
 
-	g_ptr_array_free(states, TRUE);
+/* The journal, the probe and the grouping into albums all need the album
+ * key, so it is read once per file before any of them. Only reading the
+ * tags is worth a pool. */
+static void
+read_album_keys(GSList *files)
+{
+	GThreadPool *pool = NULL;
 
-	g_free(current_dir);
-	current_dir = NULL;
-	g_slist_free(files_in_current_dir);
-	files_in_current_dir = NULL;
+	if (album_from_tags && !force_as_album) {
+		pool = g_thread_pool_new((GFunc)album_key_job_work_item, NULL,
+		    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+	}
+	for (; files; files = g_slist_next(files)) {
+		if (pool) {
+			g_thread_pool_push(pool, files->data, NULL);
+		} else {
+			album_key_job_work_item(files->data, NULL);
+		}
+	}
+	if (pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
 }
 
 static void
-calculate_album_gain_and_peak(struct filename_list_node *fln, gpointer unused)
+free_album_key(struct filename_list_node *fln, gpointer unused)
 {
-	gchar *dirname;
+	struct file_data *fd = (struct file_data *)fln->d;
 
 	(void)unused;
-	dirname = g_path_get_dirname(fln->fr->raw);
-	if (!current_dir) {
-		current_dir = g_strdup(dirname);
+	if (fd) {
+		g_free(fd->album_key);
+		fd->album_key = NULL;
 	}
-	if (!strcmp(current_dir, dirname)) {
-		files_in_current_dir = g_slist_prepend(files_in_current_dir,
-		    fln);
-	} else {
-		calculate_album_gain_and_peak_last_dir();
-		current_dir = g_strdup(dirname);
-		files_in_current_dir = g_slist_prepend(files_in_current_dir,
-		    fln);
+}
+
+/* Keys are read up front by the command line modes; callers of
+ * scan_files() like the drop frontends get them read here. Must g_free. */
+static gchar *
+get_album_key(struct filename_list_node *fln)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	if (!fd->album_key) {
+		fd->album_key = read_album_key(fln);
 	}
-	g_free(dirname);
+	return g_strdup(fd->album_key);
 }
 
-/* must g_free basename and filename */
+/* Files are grouped into albums through a hash table on the album key, so
+ * they may come in any order. An album is final as soon as the last of its
+ * files is scanned. */
+struct album {
+	GSList *files;
+	guint pending;
+	gboolean done;
+};
+
+static GHashTable *albums;	/* album key -> struct album */
+static GHashTable *file_albums; /* filename_list_node -> struct album */
+static GMutex album_mutex;
+
 static void
-get_filename_and_extension(struct filename_list_node *fln, char **basename,
-    char **extension, char **filename)
+free_album(struct album *album)
 {
-	*basename = g_path_get_basename(fln->fr->raw);
-	*extension = strrchr(*basename, '.');
-	if (*extension) {
-		++*extension;
+	g_slist_free(album->files);
+	g_free(album);
+}
+
+static void
+calculate_album_gain_and_peak(struct album *album)
+{
+	double album_data[] = { 0.0, 0.0 };
+	GPtrArray *states = g_ptr_array_new();
+	GPtrArray *histograms = g_ptr_array_new();
+	struct file_data result;
+	memcpy(&result, &empty, sizeof empty);
+
+	g_slist_foreach(album->files, (GFunc)get_state, states);
+	g_slist_foreach(album->files, (GFunc)get_block_histogram, histograms);
+	/* tracks restored from a stored histogram have no state */
+	if (histograms->len > states->len) {
+		album_data[0] = block_histogram_loudness(
+		    (guint32 **)histograms->pdata, histograms->len);
 	} else {
-		*extension = "";
+		ebur128_loudness_global_multiple(
+		    (ebur128_state **)states->pdata, states->len,
+		    &album_data[0]);
+	}
+	album_data[0] = RG_REFERENCE_LEVEL - album_data[0];
+	g_slist_foreach(album->files, (GFunc)get_max_peaks, &result);
+	album_data[1] = result.peak;
+	g_slist_foreach(album->files, (GFunc)fill_album_data, album_data);
+
+	g_ptr_array_free(states, TRUE);
+	g_ptr_array_free(histograms, TRUE);
+}
+
+/* Segments are only reported, the tags hold the gain of the whole file.
+ * Their lines leave the album columns empty. */
+static void
+print_segment_data(struct file_data *fd)
+{
+	size_t i;
+
+	for (i = 0; i < fd->nr_segments; ++i) {
+		struct segment_data *segment = &fd->segments[i];
+		double gain = clamp_rg(RG_REFERENCE_LEVEL - segment->loudness);
+		gchar *display = segment_display_name(segment, i);
+
+		if (!track) {
+			g_print("%12s%7.2f dB, %12s%10.6f", "", gain, "",
+			    segment->peak);
+		} else {
+			g_print("%7.2f dB, %10.6f", gain, segment->peak);
+		}
+		g_print(", ");
+		print_utf8_string(display);
+		putchar('\n');
+		g_free(display);
 	}
-#ifdef G_OS_WIN32
-	*filename = (char *)g_utf8_to_utf16(fln->fr->raw, -1, NULL, NULL, NULL);
-#else
-	*filename = g_strdup(fln->fr->raw);
-#endif
 }
 
 static void
@@ -219,6 +384,7 @@ print_file_data(struct filename_list_node *fln, gpointer unused)
 			!track,
 			fd->gain_album,
 			fd->peak_album,
+			NULL,
 		};
 
 		char *basename;
@@ -245,148 +411,1212 @@ print_file_data(struct filename_list_node *fln, gpointer unused)
 			print_utf8_string(fln->fr->display);
 		}
 		putchar('\n');
+		print_segment_data(fd);
 	}
 }
 
-static int tag_output_state = 0;
-void
-tag_file(struct filename_list_node *fln, int *ret)
+static int
+write_tags(struct filename_list_node *fln, TagWriteInfo *write_info)
 {
 	struct file_data *fd = (struct file_data *)fln->d;
-	if (fd->scanned) {
-		int error;
+	int error;
 
-		struct gain_data gd = {
-			RG_REFERENCE_LEVEL - fd->loudness,
-			fd->peak,
-			!track,
-			fd->gain_album,
-			fd->peak_album,
-		};
+	gchar *block_histogram = store_histograms && fd->block_histogram ?
+		  block_histogram_to_string(fd->block_histogram, fd->peak) :
+		  NULL;
+	struct gain_data gd = {
+		RG_REFERENCE_LEVEL - fd->loudness,
+		fd->peak,
+		!track,
+		fd->gain_album,
+		fd->peak_album,
+		block_histogram,
+	};
 
-		char *basename;
-		char *extension;
-		char *filename;
-		get_filename_and_extension(fln, &basename, &extension,
-		    &filename);
+	char *basename;
+	char *extension;
+	char *filename;
+	get_filename_and_extension(fln, &basename, &extension, &filename);
 
-		error = set_rg_info(filename, extension, &gd, &opus_tag_info);
-		if (error) {
-			if (tag_output_state == 0) {
-				fflush(stderr);
-				fputc('\n', stderr);
-				tag_output_state = 1;
-			}
+	write_info->padding = (unsigned long)tag_padding;
+	write_info->refuse_rewrite = no_rewrite != FALSE;
+	error = set_rg_info(filename, extension, &gd, &opus_tag_info,
+	    write_info);
+
+	g_free(basename);
+	g_free(filename);
+	g_free(block_histogram);
+
+	return error;
+}
+
+/* bytes written by tag updates that fit in place, and by those that had to
+ * move the audio data */
+static struct {
+	guint files_patched;
+	guint64 bytes_patched;
+	guint files_rewritten;
+	guint64 bytes_rewritten;
+} tag_stats;
+
+static int tag_output_state = 0;
+
+static void
+report_tag_result(struct filename_list_node *fln, int error,
+    TagWriteInfo const *write_info, int *ret)
+{
+	if (error) {
+		if (tag_output_state == 0) {
+			fflush(stderr);
+			fputc('\n', stderr);
+			tag_output_state = 1;
+		}
+		if (error == RG_NEEDS_REWRITE) {
+			g_message("Not tagging %s: tags don't fit in place",
+			    fln->fr->display);
+		} else {
 			g_message("Error tagging %s", fln->fr->display);
-			*ret = EXIT_FAILURE;
+		}
+		*ret = EXIT_FAILURE;
+	} else {
+		tag_output_state = 0;
+		if (write_info->rewritten) {
+			++tag_stats.files_rewritten;
+			tag_stats.bytes_rewritten += write_info->bytes_written;
 		} else {
-			fputc('.', stderr);
-			tag_output_state = 0;
+			++tag_stats.files_patched;
+			tag_stats.bytes_patched += write_info->bytes_written;
 		}
+	}
+}
 
-		g_free(basename);
-		g_free(filename);
+/* The journal lists the files whose tags are written and on disk, one line
+ * "SIZE MTIME FILENAME" each, so that a rerun can skip them. Written files
+ * are collected in batches; a batch is synced first and then appended to
+ * the journal, which is synced once per batch. */
+#define JOURNAL_BATCH_SIZE 64
+
+struct journal_entry {
+	gchar *filename;
+	gint64 size;
+	gint64 mtime;
+};
+
+static FILE *journal;
+/* journal_mutex guards journal_batch, journal_write_mutex the journal */
+static GPtrArray *journal_batch;
+static GMutex journal_mutex;
+static GMutex journal_write_mutex;
+
+static int
+sync_fd(int fd)
+{
+#ifdef G_OS_WIN32
+	return _commit(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static int
+sync_file(char const *filename)
+{
+	int fd = g_open(filename, O_RDWR, 0);
+	int ret;
+
+	if (fd < 0) {
+		return -1;
 	}
+	ret = sync_fd(fd);
+#ifdef G_OS_WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+	return ret;
 }
 
-int
-scan_files(GSList *files)
+static void
+free_journal_entry(struct journal_entry *entry)
 {
-	struct scan_opts opts = { FALSE, "sample", histogram, TRUE,
-		decode_to_file };
-	int do_scan = 0;
+	g_free(entry->filename);
+	g_free(entry);
+}
 
-	g_slist_foreach(files, (GFunc)init_and_get_number_of_frames, &do_scan);
-	if (do_scan) {
+static GPtrArray *
+new_journal_batch(void)
+{
+	return g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)free_journal_entry);
+}
 
-		process_files(files, &opts);
+/* Syncs the files of a batch that is no longer shared and appends them to
+ * the journal. The tag workers can meanwhile collect the next batch. Each
+ * file is synced on its own, which unlike sync() leaves the rest of the
+ * system alone. */
+static void
+flush_journal_batch(GPtrArray *batch)
+{
+	GString *lines = g_string_new(NULL);
+	guint i;
 
-		if (!track) {
-			if (force_as_album) {
-				files_in_current_dir = g_slist_copy(files);
-			} else {
-				g_slist_foreach(files,
-				    (GFunc)calculate_album_gain_and_peak, NULL);
-			}
-			calculate_album_gain_and_peak_last_dir();
-		}
+	for (i = 0; i < batch->len; ++i) {
+		struct journal_entry *entry = g_ptr_array_index(batch, i);
+		gchar *escaped;
 
-		clear_line();
-		if (!track) {
-			fprintf(stderr,
-			    "Album gain, Track gain, Album peak, Track peak\n");
-		} else {
-			fprintf(stderr, "Track gain, Track peak\n");
+		if (sync_file(entry->filename)) {
+			continue;
 		}
-		g_slist_foreach(files, (GFunc)print_file_data, NULL);
+		escaped = g_strescape(entry->filename, NULL);
+		g_string_append_printf(lines,
+		    "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s\n",
+		    entry->size, entry->mtime, escaped);
+		g_free(escaped);
 	}
-	g_slist_foreach(files, (GFunc)destroy_state, NULL);
-	scanner_reset_common();
+	g_ptr_array_free(batch, TRUE);
 
-	return do_scan;
+	g_mutex_lock(&journal_write_mutex);
+	fputs(lines->str, journal);
+	fflush(journal);
+	sync_fd(fileno(journal));
+	g_mutex_unlock(&journal_write_mutex);
+	g_string_free(lines, TRUE);
 }
 
-int
-tag_files(GSList *files)
+/* called from the tag workers after a successful write */
+static void
+journal_add(struct filename_list_node *fln)
 {
-	int ret = 0;
+	struct journal_entry *entry;
+	GPtrArray *full_batch = NULL;
+	GStatBuf stat_buf;
 
-	fprintf(stderr, "Tagging");
-	g_slist_foreach(files, (GFunc)tag_file, &ret);
-	if (ret == 0) {
-		fprintf(stderr, " Success!");
+	if (!journal || g_stat(fln->fr->raw, &stat_buf)) {
+		return;
 	}
-	fputc('\n', stderr);
+	entry = g_new(struct journal_entry, 1);
+	entry->filename = g_strdup(fln->fr->raw);
+	entry->size = (gint64)stat_buf.st_size;
+	entry->mtime = (gint64)stat_buf.st_mtime;
 
-	return ret;
+	g_mutex_lock(&journal_mutex);
+	g_ptr_array_add(journal_batch, entry);
+	if (journal_batch->len >= JOURNAL_BATCH_SIZE) {
+		full_batch = journal_batch;
+		journal_batch = new_journal_batch();
+	}
+	g_mutex_unlock(&journal_mutex);
+	if (full_batch) {
+		flush_journal_batch(full_batch);
+	}
 }
 
-static void
-append_to_untagged_list(struct filename_list_node *fln, GSList **ret)
+/* filename -> "SIZE MTIME" of the journaled files */
+static GHashTable *
+read_journal(void)
 {
-	char *basename;
-	char *extension;
-	char *filename;
-	get_filename_and_extension(fln, &basename, &extension, &filename);
+	GHashTable *journaled = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, g_free);
+	gchar *contents;
+	gchar **lines;
+	gchar **line;
 
-	if (!has_rg_info(filename, extension, &opus_tag_info)) {
-		*ret = g_slist_prepend(*ret, fln);
+	if (!g_file_get_contents(journal_file, &contents, NULL, NULL)) {
+		return journaled;
+	}
+	lines = g_strsplit(contents, "\n", -1);
+	/* the last element is empty or a line cut off by a crash */
+	for (line = lines; line[0] && line[1]; ++line) {
+		gchar *name = strchr(*line, ' ');
+		if (name) {
+			name = strchr(name + 1, ' ');
+		}
+		if (!name) {
+			continue;
+		}
+		g_hash_table_replace(journaled, g_strcompress(name + 1),
+		    g_strndup(*line, (gsize)(name - *line)));
 	}
+	g_strfreev(lines);
+	g_free(contents);
 
-	g_free(basename);
-	g_free(filename);
+	return journaled;
 }
 
-int
-loudness_tag(GSList *files)
+static gboolean
+is_journaled(GHashTable *journaled, struct filename_list_node *fln)
 {
-	if (incremental_tagging) {
-		GSList *untagged_files = NULL;
-		g_slist_foreach(files, (GFunc)append_to_untagged_list,
-		    &untagged_files);
-		untagged_files = g_slist_reverse(untagged_files);
+	gchar const *stamp = g_hash_table_lookup(journaled, fln->fr->raw);
+	GStatBuf stat_buf;
+	gchar *current;
+	gboolean ret;
 
-		files = untagged_files;
+	if (!stamp || g_stat(fln->fr->raw, &stat_buf)) {
+		return FALSE;
 	}
+	current = g_strdup_printf("%" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+	    (gint64)stat_buf.st_size, (gint64)stat_buf.st_mtime);
+	ret = !strcmp(stamp, current);
+	g_free(current);
+	return ret;
+}
 
-	if (scan_files(files) && !dry_run) {
-		return tag_files(files);
+/* files sharing a key are skipped or tagged together */
+static gchar *
+get_resume_key(struct filename_list_node *fln)
+{
+	return track ? g_strdup(fln->fr->raw) : get_album_key(fln);
+}
+
+/* Returns the files that still need tags. Files changed since they were
+ * journaled are done again. The album gain needs all tracks, so an album
+ * is only skipped if all of its files are journaled. */
+static GSList *
+get_unjournaled_files(GSList *files)
+{
+	GHashTable *journaled = read_journal();
+	GHashTable *open_albums = g_hash_table_new_full(g_str_hash,
+	    g_str_equal, g_free, NULL);
+	GSList *remaining_files = NULL;
+	GSList *it;
+
+	for (it = files; it; it = g_slist_next(it)) {
+		if (!is_journaled(journaled, it->data)) {
+			g_hash_table_add(open_albums,
+			    get_resume_key(it->data));
+		}
+	}
+	for (it = files; it; it = g_slist_next(it)) {
+		struct filename_list_node *fln = it->data;
+		gchar *key = get_resume_key(fln);
+		if (g_hash_table_contains(open_albums, key)) {
+			remaining_files = g_slist_prepend(remaining_files,
+			    fln);
+		}
+		g_free(key);
+	}
+	fprintf(stderr, "%u of %u files already tagged according to %s\n",
+	    g_slist_length(files) - g_slist_length(remaining_files),
+	    g_slist_length(files), journal_file);
+
+	g_hash_table_destroy(open_albums);
+	g_hash_table_destroy(journaled);
+
+	return g_slist_reverse(remaining_files);
+}
+
+static int
+open_journal(void)
+{
+	gchar *contents = NULL;
+	gsize length = 0;
+
+	journal = g_fopen(journal_file, "ab");
+	if (!journal) {
+		fprintf(stderr, "Could not open journal %s\n", journal_file);
+		return 1;
 	}
+	/* terminate a line cut off by a crash */
+	if (g_file_get_contents(journal_file, &contents, &length, NULL) &&
+	    length > 0 && contents[length - 1] != '\n') {
+		fputc('\n', journal);
+	}
+	g_free(contents);
+	journal_batch = new_journal_batch();
 	return 0;
 }
 
-gboolean
-loudness_tag_parse(int *argc, char **argv[])
+/* called once the tag workers are done */
+static void
+close_journal(void)
 {
-	gboolean success = parse_mode_args(argc, argv, entries);
-	if (!success) {
-		if (*argc == 1) {
-			fprintf(stderr, "Missing arguments\n");
+	flush_journal_batch(journal_batch);
+	journal_batch = NULL;
+	fclose(journal);
+	journal = NULL;
+}
+
+void
+tag_file(struct filename_list_node *fln, int *ret)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+	TagWriteInfo write_info;
+	int error;
+
+	if (fd->scanned) {
+		error = write_tags(fln, &write_info);
+		if (!error) {
+			journal_add(fln);
+		}
+		report_tag_result(fln, error, &write_info, ret);
+		if (!error) {
+			fputc('.', stderr);
 		}
-		return FALSE;
+	}
+}
+
+/* Tag writes are I/O bound, so they run on their own pool. Results are
+ * reported in list order once all writes are done. */
+struct tag_job {
+	struct filename_list_node *fln;
+	TagWriteInfo write_info;
+	int error;
+};
+
+/* A dot goes out for every tag written. Writes that finish while the scan
+ * still draws its progress bar are counted and get their dots once the
+ * "Tagging" line is started. */
+static GMutex tag_progress_mutex;
+static gboolean tag_progress_started;
+static guint tag_progress_pending;
+
+static void
+tag_progress(int error)
+{
+	if (error) {
+		return;
+	}
+	g_mutex_lock(&tag_progress_mutex);
+	if (tag_progress_started) {
+		fputc('.', stderr);
+	} else {
+		++tag_progress_pending;
+	}
+	g_mutex_unlock(&tag_progress_mutex);
+}
+
+static void
+start_tag_progress(void)
+{
+	g_mutex_lock(&tag_progress_mutex);
+	fprintf(stderr, "Tagging");
+	for (; tag_progress_pending > 0; --tag_progress_pending) {
+		fputc('.', stderr);
+	}
+	tag_progress_started = TRUE;
+	g_mutex_unlock(&tag_progress_mutex);
+}
+
+static void
+tag_job_work_item(struct tag_job *job, gpointer unused)
+{
+	(void)unused;
+	job->error = write_tags(job->fln, &job->write_info);
+	if (!job->error) {
+		journal_add(job->fln);
+	}
+	tag_progress(job->error);
+}
+
+/* Each file is handed to tag_pool as soon as its gain is final: right after
+ * its scan in track mode, after the last file of its album otherwise. Tag
+ * writes then overlap decoding, and an interrupted run keeps the tags
+ * written so far. */
+static GThreadPool *tag_pool;
+
+static void
+queue_tag_job(struct filename_list_node *fln, gpointer unused)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+	struct tag_job *job;
+
+	(void)unused;
+	if (!fd->scanned) {
+		return;
+	}
+	job = g_new0(struct tag_job, 1);
+	job->fln = fln;
+	fd->user = job;
+	g_thread_pool_push(tag_pool, job, NULL);
+}
+
+static void
+report_queued_tag_job(struct filename_list_node *fln, int *ret)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+	struct tag_job *job = fd->user;
+
+	if (job) {
+		report_tag_result(fln, job->error, &job->write_info, ret);
+		g_free(job);
+		fd->user = NULL;
+	}
+}
+
+/* jobs that are not reported because nothing is left to tag */
+static void
+free_queued_tag_job(struct filename_list_node *fln, gpointer unused)
+{
+	struct file_data *fd = (struct file_data *)fln->d;
+
+	(void)unused;
+	if (fd) {
+		g_free(fd->user);
+		fd->user = NULL;
+	}
+}
+
+/* Already tagged tracks of an album that gets new tracks in incremental
+ * mode. Their stored block histogram stands in for a scan in the album
+ * gain; their track gain and peak are kept as they are in the tags. */
+struct stored_track {
+	guint32 *block_histogram;
+	double peak;
+	double track_gain;
+	double track_peak;
+};
+
+static GHashTable *stored_tracks;
+
+static void
+free_stored_track(struct stored_track *stored)
+{
+	g_free(stored->block_histogram);
+	g_free(stored);
+}
+
+static void
+init_file(struct filename_list_node *fln, int *do_scan)
+{
+	struct stored_track *stored = NULL;
+	struct file_data *fd;
+
+	if (stored_tracks) {
+		stored = g_hash_table_lookup(stored_tracks, fln);
+	}
+	if (!stored) {
+		init_and_get_number_of_frames(fln, do_scan);
+		return;
+	}
+
+	if (!fln->d) {
+		fln->d = g_malloc(sizeof(struct file_data));
+		memcpy(fln->d, &empty, sizeof empty);
+	}
+	fd = (struct file_data *)fln->d;
+	fd->block_histogram = stored->block_histogram;
+	stored->block_histogram = NULL;
+	/* the binned histogram only approximates the loudness, so the track
+	 * gain is written back exactly as it was read */
+	fd->loudness = RG_REFERENCE_LEVEL - stored->track_gain;
+	fd->peak = isnan(stored->track_peak) ? stored->peak :
+						     stored->track_peak;
+	fd->scanned = TRUE;
+}
+
+static void
+append_file_to_scan(struct filename_list_node *fln, GSList **files_to_scan)
+{
+	if (!stored_tracks || !g_hash_table_contains(stored_tracks, fln)) {
+		*files_to_scan = g_slist_prepend(*files_to_scan, fln);
+	}
+}
+
+static void
+add_file_to_album(struct filename_list_node *fln, gpointer unused)
+{
+	gchar *key = get_album_key(fln);
+	struct album *album = g_hash_table_lookup(albums, key);
+
+	(void)unused;
+	if (!album) {
+		album = g_new0(struct album, 1);
+		g_hash_table_insert(albums, key, album);
+	} else {
+		g_free(key);
+	}
+	album->files = g_slist_prepend(album->files, fln);
+	if (!stored_tracks || !g_hash_table_contains(stored_tracks, fln)) {
+		++album->pending;
+	}
+	g_hash_table_insert(file_albums, fln, album);
+}
+
+static void
+finish_album(struct album *album)
+{
+	album->done = TRUE;
+	calculate_album_gain_and_peak(album);
+	if (tag_pool) {
+		g_slist_foreach(album->files, (GFunc)queue_tag_job, NULL);
+	}
+}
+
+/* called from the scan workers */
+static void
+album_file_done(struct filename_list_node *fln, gpointer unused)
+{
+	struct album *album;
+
+	(void)unused;
+	g_mutex_lock(&album_mutex);
+	album = g_hash_table_lookup(file_albums, fln);
+	if (--album->pending == 0) {
+		finish_album(album);
+	}
+	g_mutex_unlock(&album_mutex);
+}
+
+static void
+finish_remaining_album(gpointer key, struct album *album, gpointer unused)
+{
+	(void)key;
+	(void)unused;
+	if (!album->done) {
+		finish_album(album);
+	}
+}
+
+/* Scans the files and computes their track and album gains. */
+static int
+analyse_files(GSList *files)
+{
+	/* with stored histograms in play, every track of an album needs one */
+	struct scan_opts opts = { FALSE, "sample", histogram, TRUE,
+		decode_to_file, 0, 0.0,
+		store_histograms || verify_use_histograms, segments, FALSE, 0.0,
+		0.0, NULL, NULL };
+	int do_scan = 0;
+
+	g_slist_foreach(files, (GFunc)init_file, &do_scan);
+	if (do_scan) {
+		GSList *files_to_scan = NULL;
+
+		if (!track) {
+			albums = g_hash_table_new_full(g_str_hash, g_str_equal,
+			    g_free, (GDestroyNotify)free_album);
+			file_albums = g_hash_table_new(g_direct_hash,
+			    g_direct_equal);
+			g_slist_foreach(files, (GFunc)add_file_to_album, NULL);
+			opts.file_done = (GFunc)album_file_done;
+		} else if (tag_pool) {
+			opts.file_done = (GFunc)queue_tag_job;
+		}
+
+		g_slist_foreach(files, (GFunc)append_file_to_scan,
+		    &files_to_scan);
+		files_to_scan = g_slist_reverse(files_to_scan);
+		process_files(files_to_scan, &opts);
+		g_slist_free(files_to_scan);
+
+		if (!track) {
+			g_hash_table_foreach(albums,
+			    (GHFunc)finish_remaining_album, NULL);
+			g_hash_table_destroy(file_albums);
+			file_albums = NULL;
+			g_hash_table_destroy(albums);
+			albums = NULL;
+		}
+	}
+	return do_scan;
+}
+
+int
+scan_files(GSList *files)
+{
+	int do_scan = analyse_files(files);
+
+	if (do_scan) {
+		clear_line();
+		if (!track) {
+			fprintf(stderr,
+			    "Album gain, Track gain, Album peak, Track peak\n");
+		} else {
+			fprintf(stderr, "Track gain, Track peak\n");
+		}
+		g_slist_foreach(files, (GFunc)print_file_data, NULL);
+		if (tag_pool) {
+			start_tag_progress();
+		}
+	}
+	if (tag_pool) {
+		g_thread_pool_free(tag_pool, FALSE, TRUE);
+		tag_pool = NULL;
+		tag_progress_started = FALSE;
+		tag_progress_pending = 0;
+	}
+	g_slist_foreach(files, (GFunc)destroy_state, NULL);
+	g_slist_foreach(files, (GFunc)free_album_key, NULL);
+	scanner_reset_common();
+
+	return do_scan;
+}
+
+/* Reports the tags written by the jobs that scan_files queued on tag_pool,
+ * after the dots printed while they ran: failures in list order, then the
+ * totals. */
+int
+tag_files(GSList *files)
+{
+	int ret = 0;
+
+	memset(&tag_stats, '\0', sizeof tag_stats);
+	g_slist_foreach(files, (GFunc)report_queued_tag_job, &ret);
+	if (ret == 0) {
+		fprintf(stderr, " Success!");
+	}
+	fputc('\n', stderr);
+	fprintf(stderr,
+	    "%u files updated in place (%" G_GUINT64_FORMAT " bytes), "
+	    "%u rewritten (%" G_GUINT64_FORMAT " bytes)\n",
+	    tag_stats.files_patched, tag_stats.bytes_patched,
+	    tag_stats.files_rewritten, tag_stats.bytes_rewritten);
+
+	return ret;
+}
+
+static gboolean
+file_has_rg_info(struct filename_list_node *fln)
+{
+	gboolean ret;
+	char *basename;
+	char *extension;
+	char *filename;
+	get_filename_and_extension(fln, &basename, &extension, &filename);
+
+	ret = has_rg_info(filename, extension, &opus_tag_info);
+
+	g_free(basename);
+	g_free(filename);
+
+	return ret;
+}
+
+/* Checking for existing tags only reads tags, so like tag writes it is I/O
+ * bound and runs on a pool of tag_threads threads. */
+struct probe_job {
+	struct filename_list_node *fln;
+	gboolean tagged;
+	struct stored_track *stored;
+};
+
+static struct stored_track *
+read_stored_track(struct filename_list_node *fln)
+{
+	struct stored_track *stored = NULL;
+	char *basename;
+	char *extension;
+	char *filename;
+	char *str;
+	get_filename_and_extension(fln, &basename, &extension, &filename);
+
+	str = get_block_histogram_tag(filename, extension);
+	if (str) {
+		stored = g_new0(struct stored_track, 1);
+		stored->block_histogram = block_histogram_from_string(str,
+		    &stored->peak);
+		if (!stored->block_histogram) {
+			g_free(stored);
+			stored = NULL;
+		}
+		free(str);
+	}
+
+	g_free(basename);
+	g_free(filename);
+
+	return stored;
+}
+
+/* A track is only restored if its track gain can be kept as well. */
+static void
+read_stored_track_gain(struct probe_job *job)
+{
+	struct gain_data gd;
+	char *basename;
+	char *extension;
+	char *filename;
+	get_filename_and_extension(job->fln, &basename, &extension, &filename);
+
+	if (get_rg_info(filename, extension, &gd)) {
+		job->stored->track_gain = gd.track_gain;
+		job->stored->track_peak = gd.track_peak;
+	} else {
+		free_stored_track(job->stored);
+		job->stored = NULL;
+	}
+
+	g_free(basename);
+	g_free(filename);
+}
+
+static void
+probe_job_work_item(struct probe_job *job, gpointer unused)
+{
+	(void)unused;
+	job->tagged = file_has_rg_info(job->fln);
+	if (job->tagged && store_histograms && !track) {
+		job->stored = read_stored_track(job->fln);
+		if (job->stored) {
+			read_stored_track_gain(job);
+		}
+	}
+}
+
+/* Returns the files without tags. If histograms are stored, a new track
+ * changes the album gain of its whole album, so the tagged tracks of such
+ * albums are returned as well; those with a stored histogram go to
+ * stored_tracks and are not decoded again. */
+static GSList *
+get_untagged_files(GSList *files)
+{
+	GSList *untagged_files = NULL;
+	guint nr_files = g_slist_length(files);
+	struct probe_job *jobs = g_new0(struct probe_job, nr_files);
+	GHashTable *albums = NULL;
+	GThreadPool *pool;
+	guint i;
+
+	pool = g_thread_pool_new((GFunc)probe_job_work_item, NULL,
+	    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+	for (i = 0; files; files = g_slist_next(files), ++i) {
+		jobs[i].fln = files->data;
+		g_thread_pool_push(pool, &jobs[i], NULL);
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (store_histograms && !track) {
+		albums = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		    NULL);
+		stored_tracks = g_hash_table_new_full(g_direct_hash,
+		    g_direct_equal, NULL, (GDestroyNotify)free_stored_track);
+		for (i = 0; i < nr_files; ++i) {
+			if (!jobs[i].tagged) {
+				g_hash_table_add(albums,
+				    get_album_key(jobs[i].fln));
+			}
+		}
+	}
+
+	for (i = 0; i < nr_files; ++i) {
+		gboolean wanted = !jobs[i].tagged;
+		if (!wanted && albums) {
+			gchar *album_key = get_album_key(jobs[i].fln);
+			wanted = g_hash_table_contains(albums, album_key);
+			g_free(album_key);
+		}
+		if (wanted) {
+			untagged_files = g_slist_prepend(untagged_files,
+			    jobs[i].fln);
+		}
+		if (wanted && jobs[i].stored) {
+			g_hash_table_insert(stored_tracks, jobs[i].fln,
+			    jobs[i].stored);
+		} else if (jobs[i].stored) {
+			free_stored_track(jobs[i].stored);
+		}
+	}
+	if (albums) {
+		g_hash_table_destroy(albums);
+	}
+	g_free(jobs);
+
+	return g_slist_reverse(untagged_files);
+}
+
+int
+loudness_tag(GSList *files)
+{
+	GSList *all_files = files;
+	int ret = 0;
+
+	if (!track) {
+		read_album_keys(files);
+	}
+	if (journal_file && !dry_run) {
+		files = get_unjournaled_files(files);
+		if (open_journal()) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+	if (incremental_tagging) {
+		GSList *untagged_files = get_untagged_files(files);
+		if (files != all_files) {
+			g_slist_free(files);
+		}
+		files = untagged_files;
+	}
+
+	if (!dry_run) {
+		tag_pool = g_thread_pool_new((GFunc)tag_job_work_item, NULL,
+		    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+	}
+	if (scan_files(files) && !dry_run) {
+		ret = tag_files(files);
+	} else {
+		g_slist_foreach(files, (GFunc)free_queued_tag_job, NULL);
+	}
+	if (stored_tracks) {
+		g_hash_table_destroy(stored_tracks);
+		stored_tracks = NULL;
+	}
+	if (journal) {
+		close_journal();
+	}
+
+out:
+	if (files != all_files) {
+		g_slist_free(files);
+	}
+	g_slist_foreach(all_files, (GFunc)free_album_key, NULL);
+	g_free(journal_file);
+	journal_file = NULL;
+	return ret;
+}
+
+gboolean
+loudness_tag_parse(int *argc, char **argv[])
+{
+	gboolean success = parse_mode_args(argc, argv, entries);
+	if (!success) {
+		if (*argc == 1) {
+			fprintf(stderr, "Missing arguments\n");
+		}
+		return FALSE;
 	}
 
 	opus_tag_info.vorbisgain_compat = opus_vorbisgain_compat != FALSE;
 
+	if (tag_threads < 0) {
+		fprintf(stderr, "Invalid number of tag threads\n");
+		return FALSE;
+	}
+	if (tag_padding < 0) {
+		fprintf(stderr, "Invalid tag padding\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* "loudness scan --from-tags": files whose tags hold a track gain (and a
+ * peak, if needed) get their results from the tags instead of a scan. */
+struct tag_result_job {
+	struct filename_list_node *fln;
+	gboolean need_peak;
+	gboolean usable;
+	struct gain_data gd;
+	struct stored_track *stored;
+	double length;
+};
+
+static void
+tag_result_job_work_item(struct tag_result_job *job, gpointer unused)
+{
+	char *basename;
+	char *extension;
+	char *filename;
+
+	(void)unused;
+	get_filename_and_extension(job->fln, &basename, &extension, &filename);
+	job->usable = get_rg_info(filename, extension, &job->gd) &&
+	    (!job->need_peak || !isnan(job->gd.track_peak));
+	if (job->usable) {
+		job->stored = read_stored_track(job->fln);
+	}
+	g_free(basename);
+	g_free(filename);
+}
+
+static void
+tag_result_length_work_item(struct tag_result_job *job, gpointer unused)
+{
+	char *basename;
+	char *extension;
+	char *filename;
+
+	(void)unused;
+	get_filename_and_extension(job->fln, &basename, &extension, &filename);
+	job->length = get_audio_length(filename);
+	g_free(basename);
+	g_free(filename);
+}
+
+/* Returns the files that still have to be scanned. */
+GSList *
+read_results_from_tags(GSList *files, gboolean need_peak)
+{
+	GSList *untagged_files = NULL;
+	guint nr_files = g_slist_length(files);
+	struct tag_result_job *jobs = g_new0(struct tag_result_job, nr_files);
+	gboolean need_length = FALSE;
+	GThreadPool *pool;
+	guint i;
+
+	pool = g_thread_pool_new((GFunc)tag_result_job_work_item, NULL,
+	    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+	for (i = 0; files; files = g_slist_next(files), ++i) {
+		jobs[i].fln = files->data;
+		jobs[i].need_peak = need_peak;
+		g_thread_pool_push(pool, &jobs[i], NULL);
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	/* the length only weighs the tracks in the summary if a tagged file
+	 * has no stored histogram */
+	for (i = 0; i < nr_files; ++i) {
+		if (jobs[i].usable && !jobs[i].stored) {
+			need_length = TRUE;
+		}
+	}
+	if (need_length) {
+		pool = g_thread_pool_new((GFunc)tag_result_length_work_item,
+		    NULL, tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+		for (i = 0; i < nr_files; ++i) {
+			if (jobs[i].usable) {
+				g_thread_pool_push(pool, &jobs[i], NULL);
+			}
+		}
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+
+	for (i = 0; i < nr_files; ++i) {
+		struct file_data *fd;
+
+		if (!jobs[i].usable) {
+			untagged_files = g_slist_prepend(untagged_files,
+			    jobs[i].fln);
+			continue;
+		}
+		jobs[i].fln->d = g_malloc(sizeof(struct file_data));
+		memcpy(jobs[i].fln->d, &empty, sizeof empty);
+		fd = (struct file_data *)jobs[i].fln->d;
+		fd->loudness = RG_REFERENCE_LEVEL - jobs[i].gd.track_gain;
+		fd->peak = isnan(jobs[i].gd.track_peak) ?
+			  0.0 :
+			  jobs[i].gd.track_peak;
+		fd->length = jobs[i].length;
+		if (jobs[i].stored) {
+			fd->block_histogram = jobs[i].stored->block_histogram;
+			jobs[i].stored->block_histogram = NULL;
+			free_stored_track(jobs[i].stored);
+		}
+		fd->scanned = TRUE;
+	}
+	g_free(jobs);
+
+	return g_slist_reverse(untagged_files);
+}
+
+/* Verify mode: tags are read on a pool while the files are analysed, then
+ * compared with the analysis. Only mismatches are printed. */
+struct verify_job {
+	struct filename_list_node *fln;
+	struct gain_data gd;
+	gboolean tagged;
+	struct stored_track *stored;
+};
+
+static void
+verify_job_work_item(struct verify_job *job, gpointer unused)
+{
+	char *basename;
+	char *extension;
+	char *filename;
+
+	(void)unused;
+	get_filename_and_extension(job->fln, &basename, &extension, &filename);
+	job->tagged = get_rg_info(filename, extension, &job->gd);
+	g_free(basename);
+	g_free(filename);
+}
+
+/* Unlike in incremental tagging, the track loudness is taken from the
+ * histogram, otherwise the tags would only be checked against themselves.
+ * The histogram holds no peak of its own to check, so the tagged one is
+ * kept. */
+static void
+read_stored_track_job(struct verify_job *job, gpointer unused)
+{
+	struct stored_track *stored;
+	struct gain_data gd;
+	char *basename;
+	char *extension;
+	char *filename;
+
+	(void)unused;
+	stored = job->stored = read_stored_track(job->fln);
+	if (!stored) {
+		return;
+	}
+	stored->track_gain = RG_REFERENCE_LEVEL -
+	    block_histogram_loudness(&stored->block_histogram, 1);
+	stored->track_peak = NAN;
+
+	get_filename_and_extension(job->fln, &basename, &extension, &filename);
+	if (get_rg_info(filename, extension, &gd)) {
+		stored->track_peak = gd.track_peak;
+	}
+	g_free(basename);
+	g_free(filename);
+}
+
+static gboolean
+gain_differs(double tagged, double measured)
+{
+	return fabs(tagged - measured) > verify_tolerance;
+}
+
+/* peaks are compared in dB, missing ones (like in Opus files) are skipped */
+static gboolean
+peak_differs(double tagged, double measured)
+{
+	if (isnan(tagged)) {
+		return FALSE;
+	}
+	if (tagged <= 0.0 || measured <= 0.0) {
+		return fabs(tagged - measured) > 1e-6;
+	}
+	return fabs(20.0 * log10(tagged / measured)) > verify_tolerance;
+}
+
+static gboolean
+print_mismatch(struct verify_job *job)
+{
+	struct file_data *fd = (struct file_data *)job->fln->d;
+	GString *diffs = g_string_new(NULL);
+	gboolean mismatch;
+	struct gain_data gd = {
+		RG_REFERENCE_LEVEL - fd->loudness,
+		fd->peak,
+		!track,
+		fd->gain_album,
+		fd->peak_album,
+		NULL,
+	};
+	clamp_gain_data(&gd);
+
+	if (!fd->scanned) {
+		g_string_append(diffs, "could not be analysed");
+	} else if (!job->tagged) {
+		g_string_append(diffs, "no ReplayGain tags");
+	} else {
+		if (gain_differs(job->gd.track_gain, gd.track_gain)) {
+			g_string_append_printf(diffs,
+			    ", track gain %.2f dB (measured %.2f dB)",
+			    job->gd.track_gain, gd.track_gain);
+		}
+		if (peak_differs(job->gd.track_peak, gd.track_peak)) {
+			g_string_append_printf(diffs,
+			    ", track peak %.6f (measured %.6f)",
+			    job->gd.track_peak, gd.track_peak);
+		}
+		/* files tagged in track mode have no album gain to compare,
+		 * which is only a mismatch if albums were asked for */
+		if (!track && !job->gd.album_mode &&
+		    (force_as_album || album_from_tags)) {
+			g_string_append(diffs, ", no album gain");
+		} else if (!track && job->gd.album_mode) {
+			if (gain_differs(job->gd.album_gain, gd.album_gain)) {
+				g_string_append_printf(diffs,
+				    ", album gain %.2f dB (measured %.2f dB)",
+				    job->gd.album_gain, gd.album_gain);
+			}
+			if (peak_differs(job->gd.album_peak, gd.album_peak)) {
+				g_string_append_printf(diffs,
+				    ", album peak %.6f (measured %.6f)",
+				    job->gd.album_peak, gd.album_peak);
+			}
+		}
+		if (diffs->len) {
+			g_string_erase(diffs, 0, 2);
+		}
+	}
+
+	mismatch = diffs->len > 0;
+	if (mismatch) {
+		g_print("%s, ", diffs->str);
+		print_utf8_string(job->fln->fr->display);
+		putchar('\n');
+	}
+	g_string_free(diffs, TRUE);
+	return mismatch;
+}
+
+int
+loudness_verify(GSList *files)
+{
+	guint nr_files = g_slist_length(files);
+	struct verify_job *jobs = g_new0(struct verify_job, nr_files);
+	guint mismatches = 0;
+	GThreadPool *pool;
+	GSList *it;
+	guint i;
+
+	for (i = 0, it = files; it; it = g_slist_next(it), ++i) {
+		jobs[i].fln = it->data;
+	}
+	if (!track) {
+		read_album_keys(files);
+	}
+
+	/* with --use-histograms, stored histograms stand in for the audio */
+	if (verify_use_histograms) {
+		pool = g_thread_pool_new((GFunc)read_stored_track_job, NULL,
+		    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+		for (i = 0; i < nr_files; ++i) {
+			g_thread_pool_push(pool, &jobs[i], NULL);
+		}
+		g_thread_pool_free(pool, FALSE, TRUE);
+		stored_tracks = g_hash_table_new_full(g_direct_hash,
+		    g_direct_equal, NULL, (GDestroyNotify)free_stored_track);
+		for (i = 0; i < nr_files; ++i) {
+			if (jobs[i].stored) {
+				g_hash_table_insert(stored_tracks, jobs[i].fln,
+				    jobs[i].stored);
+			}
+		}
+	}
+
+	pool = g_thread_pool_new((GFunc)verify_job_work_item, NULL,
+	    tag_threads > 0 ? tag_threads : nproc(), FALSE, NULL);
+	for (i = 0; i < nr_files; ++i) {
+		g_thread_pool_push(pool, &jobs[i], NULL);
+	}
+	analyse_files(files);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	clear_line();
+	for (i = 0; i < nr_files; ++i) {
+		if (jobs[i].fln->d && print_mismatch(&jobs[i])) {
+			++mismatches;
+		}
+	}
+	fprintf(stderr, "%u of %u files match\n", nr_files - mismatches,
+	    nr_files);
+
+	g_slist_foreach(files, (GFunc)destroy_state, NULL);
+	g_slist_foreach(files, (GFunc)free_album_key, NULL);
+	scanner_reset_common();
+	if (stored_tracks) {
+		g_hash_table_destroy(stored_tracks);
+		stored_tracks = NULL;
+	}
+	g_free(jobs);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+gboolean
+loudness_verify_parse(int *argc, char **argv[])
+{
+	gboolean success = parse_mode_args(argc, argv, verify_entries);
+	if (!success) {
+		if (*argc == 1) {
+			fprintf(stderr, "Missing arguments\n");
+		}
+		return FALSE;
+	}
+
+	if (tag_threads < 0) {
+		fprintf(stderr, "Invalid number of tag threads\n");
+		return FALSE;
+	}
+	if (!(verify_tolerance >= 0.0)) {
+		fprintf(stderr, "Invalid tolerance\n");
+		return FALSE;
+	}
+
 	return TRUE;
 }
@@ -15,5 +15,8 @@ int scan_files(GSList *files);
 int tag_files(GSList *files);
 int loudness_tag(GSList *files);
 gboolean loudness_tag_parse(int *argc, char **argv[]);
+GSList *read_results_from_tags(GSList *files, gboolean need_peak);
+int loudness_verify(GSList *files);
+gboolean loudness_verify_parse(int *argc, char **argv[]);
 
 #endif /* end of include guard: SCANNER_TAG_H */
@@ -13,13 +13,16 @@
 #include "filetree.h"
 #include "input.h"
 #include "parse_args.h"
+#include "prefetch.h"
 
+#include "scanner-check.h"
 #include "scanner-scan.h"
 #ifdef USE_TAGLIB
 #include "scanner-tag.h"
 #endif
 #include "scanner-common.h"
 #include "scanner-dump.h"
+#include "scanner-monitor.h"
 
 /* knobs: USE_TAGLIB, USE_SNDFILE */
 
@@ -28,7 +31,7 @@ static void
 print_help(void)
 {
 	printf(
-	    "Usage: loudness scan|tag|dump|--version [OPTION...] [FILE|DIRECTORY]...\n");
+	    "Usage: loudness scan|tag|verify|dump|monitor|check|--version [OPTION...] [FILE|DIRECTORY]...\n");
 	printf("\n");
 	printf(
 	    "`loudness' scans audio files according to the EBU R128 standard. It can output\n");
@@ -49,9 +52,17 @@ print_help(void)
 #ifdef USE_TAGLIB
 	printf(
 	    "  loudness tag -r bar/        # Tag all files in foo as one album per subfolder.\n");
+	printf(
+	    "  loudness verify -r bar/     # Print files whose tags don't match the audio.\n");
 #endif
 	printf(
 	    "  loudness dump -m 1.0 a.wav  # Each second, write momentary loudness to stdout.\n");
+	printf(
+	    "  loudness scan - < a.mka     # Scans audio read from standard input.\n");
+	printf(
+	    "  loudness monitor - < a.mka  # Meters a live stream every second.\n");
+	printf(
+	    "  loudness check -r bar/      # Checks all files against EBU R128.\n");
 	printf(
 	    "  loudness --version          # Write library and scanner version to stdout.\n");
 	printf("\n");
@@ -61,10 +72,17 @@ print_help(void)
 #ifdef USE_TAGLIB
 	printf(
 	    "  tag                        tag files with ReplayGain conformant tags\n");
+	printf(
+	    "  verify                     compare existing tags with the audio\n");
 #endif
 	printf(
 	    "  dump                       output momentary/shortterm/integrated loudness\n");
 	printf("                             in fixed intervals\n");
+	printf(
+	    "  monitor                    meter one live stream continuously\n");
+	printf(
+	    "  check                      check files against a loudness and true\n");
+	printf("                             peak specification\n");
 	printf("\n");
 	printf(" Global options:\n");
 	printf(
@@ -80,6 +98,22 @@ print_help(void)
 	    "  --force-plugin=PLUGIN      force input plugin; PLUGIN is one of:\n");
 	printf(/**/
 	    "                             sndfile, ffmpeg\n");
+	printf(
+	    "  --raw=TYPE:RATE:CHANNELS[:LAYOUT]  read input as headerless PCM\n");
+	printf(/**/
+	    "                             TYPE is one of s16le, s32le, f32le, f64le\n");
+	printf(/**/
+	    "                             (or the same with 'be'), LAYOUT is a list\n");
+	printf(/**/
+	    "                             of L, R, C, LFE, Ls, Rs, DM (dual mono), -\n");
+	printf(/**/
+	    "                               example: --raw=f32le:48000:6:L,R,C,LFE,Ls,Rs\n");
+	printf(
+	    "  --prefetch=N               warm the page cache for the next N files to\n");
+	printf(/**/
+	    "                             scan and drop scanned files from it\n");
+	printf(
+	    "  --prefetch-budget=MIB      prefetch at most MIB MiB ahead (default: 256)\n");
 #ifdef USE_SNDFILE
 	printf(
 	    "  --decode=FILE              decode one input to FILE (32 bit float WAV,\n");
@@ -98,6 +132,28 @@ print_help(void)
 	    "                                   -p dbtp:   true peak (dB True Peak)\n");
 	printf(
 	    "                                   -p all:    show all peak values\n");
+	printf(
+	    "  --estimate=N               estimate loudness from N evenly spaced windows\n");
+	printf(/**/
+	    "                             per file instead of scanning whole files\n");
+	printf(
+	    "  --estimate-window=SECONDS  length of each estimate window (default: 3)\n");
+	printf(
+	    "  --segments                 measure chapters or cue sheet tracks as well\n");
+	printf(
+	    "  --silence                  report leading and trailing silence and the\n");
+	printf(/**/
+	    "                             longest gap within each file\n");
+	printf(
+	    "  --silence-threshold=DBFS   level below which audio counts as silence\n");
+	printf(/**/
+	    "                             (default: -60)\n");
+#ifdef USE_TAGLIB
+	printf(
+	    "  --from-tags                read loudness and sample peak from existing\n");
+	printf(/**/
+	    "                             ReplayGain/R128 tags, decode untagged files\n");
+#endif
 	printf("\n");
 #ifdef USE_TAGLIB
 	printf(" Tag options:\n");
@@ -109,6 +165,34 @@ print_help(void)
 	    "  --incremental              skip files that are already tagged\n");
 	printf(
 	    "  --force-as-album           treat all given files as one album\n");
+	printf(
+	    "  --album-from-tags          group albums by ALBUMARTIST and ALBUM tags\n");
+	printf(/**/
+	    "                             instead of by directory\n");
+	printf(
+	    "  --tag-threads=N            write tags with N threads (default: number\n");
+	printf(/**/
+	    "                             of processors)\n");
+	printf(
+	    "  --store-histograms         store loudness histograms in the tags, so\n");
+	printf(/**/
+	    "                             that --incremental can compute album gain\n");
+	printf(/**/
+	    "                             without rescanning tagged tracks\n");
+	printf(
+	    "  --tag-padding=BYTES        padding to reserve when a tag has to grow\n");
+	printf(/**/
+	    "                             (ID3v2 and FLAC)\n");
+	printf(
+	    "  --no-rewrite               skip files whose tags don't fit in place\n");
+	printf(
+	    "  --journal=FILE             record tagged files in FILE and skip those\n");
+	printf(/**/
+	    "                             already recorded there\n");
+	printf(
+	    "  --segments                 report the gain of chapters or cue sheet\n");
+	printf(/**/
+	    "                             tracks as well\n");
 	printf(
 	    "  --opus-vorbisgain-compat   for compatibility with older software,\n");
 	printf(
@@ -160,6 +244,24 @@ print_help(void)
 	printf(/**/
 	    "                                   --opus-header-gain=-3:  -3dB in gain field\n");
 	printf("\n");
+	printf(" Verify options:\n");
+	printf(
+	    "  -t, --track                compare only track gain and peak\n");
+	printf(
+	    "  --force-as-album, --album-from-tags\n");
+	printf(/**/
+	    "                             group files into albums like in tag mode\n");
+	printf(
+	    "  --tag-threads=N            read tags with N threads\n");
+	printf(
+	    "  --tolerance=DB             allowed difference of gains and peaks\n");
+	printf(/**/
+	    "                             (default: 0.1)\n");
+	printf(
+	    "  --use-histograms           compare with stored loudness histograms\n");
+	printf(/**/
+	    "                             instead of decoding (see --store-histograms)\n");
+	printf("\n");
 #endif
 	printf(" Dump options:\n");
 	printf(
@@ -168,6 +270,66 @@ print_help(void)
 	    "  -s, --shortterm=INTERVAL   print shortterm loudness every INTERVAL seconds\n");
 	printf(
 	    "  -i, --integrated=INTERVAL  print integrated loudness every INTERVAL seconds\n");
+	printf(
+	    "  --lra=INTERVAL             print loudness range every INTERVAL seconds\n");
+	printf(
+	    "  --sample-peak=INTERVAL     print the sample peak of each INTERVAL seconds\n");
+	printf(
+	    "  --true-peak=INTERVAL       print the true peak of each INTERVAL seconds\n");
+	printf(
+	    "  --aggregate=last|max|mean|gated  reduce the momentary and shortterm\n");
+	printf(/**/
+	    "                             loudness of each 100ms step in an interval to\n");
+	printf(/**/
+	    "                             one value (default: last, the value at its end)\n");
+	printf(/**/
+	    "                             and print it with its time; intervals must be\n");
+	printf(/**/
+	    "                             at least 0.1 seconds\n");
+	printf(
+	    "  --envelope=INTERVAL,...    add the maximum momentary and shortterm\n");
+	printf(/**/
+	    "                             loudness at each INTERVAL, e.g. 0.1,1,10,60\n");
+	printf(
+	    "  --output-dir=DIR           write the values of each file to DIR/NAME.txt\n");
+	printf(
+	    "  --binary                   write a binary dump (little endian float32\n");
+	printf(/**/
+	    "                             columns) instead of text\n");
+	printf(
+	    "  --sinks=SINK,...           feed several outputs from one decode: text,\n");
+	printf(/**/
+	    "                             binary, summary (one line per file) and wav\n");
+	printf(/**/
+	    "                             (DIR/NAME.wav, or FILE with --decode)\n");
+	printf(
+	    "  --from-binary              print binary dumps given as FILE as text\n");
+	printf("\n");
+	printf(" Monitor options:\n");
+	printf(
+	    "  --interval=SECONDS         print an update every SECONDS (default: 1)\n");
+	printf(
+	    "  --reset=SECONDS            restart integrated loudness and LRA every\n");
+	printf(/**/
+	    "                             SECONDS\n");
+	printf(
+	    "  --window=SECONDS           measure integrated loudness and LRA over the\n");
+	printf(/**/
+	    "                             last SECONDS only\n");
+	printf("\n");
+	printf(" Check options:\n");
+	printf(
+	    "  --target=LUFS              integrated loudness to meet (default: -23)\n");
+	printf(
+	    "  --tolerance=LU             allowed deviation from the target (default: 1)\n");
+	printf(
+	    "  --max-tp=DBTP              maximum true peak (default: -1)\n");
+	printf(
+	    "  --full                     keep measuring files that exceed the true\n");
+	printf(/**/
+	    "                             peak limit instead of stopping there\n");
+	printf(
+	    "  Exit status: 0 if all files pass, 2 if one fails, 3 if one can't be read\n");
 }
 
 static gboolean recursive = FALSE;
@@ -176,6 +338,7 @@ static gboolean no_sort = FALSE;
 gboolean verbose = FALSE;
 gboolean histogram = FALSE;
 static gchar *forced_plugin = NULL;
+static gchar *raw_format = NULL;
 gchar *decode_to_file = NULL;
 static gboolean help = FALSE;
 
@@ -188,23 +351,66 @@ static GOptionEntry entries[] = { { "recursive", 'r', 0, G_OPTION_ARG_NONE,
 	{ "histogram", 0, 0, G_OPTION_ARG_NONE, &histogram, NULL, NULL },
 	{ "force-plugin", 0, 0, G_OPTION_ARG_STRING, &forced_plugin, NULL,
 	    NULL },
+	{ "raw", 0, 0, G_OPTION_ARG_STRING, &raw_format, NULL, NULL },
+	{ "prefetch", 0, 0, G_OPTION_ARG_INT, &prefetch_lookahead, NULL, NULL },
+	{ "prefetch-budget", 0, 0, G_OPTION_ARG_INT, &prefetch_budget_mb, NULL,
+	    NULL },
 #ifdef USE_SNDFILE
 	{ "decode", 0, 0, G_OPTION_ARG_STRING, &decode_to_file, NULL, NULL },
 #endif
 	{ "help", 'h', 0, G_OPTION_ARG_NONE, &help, NULL, NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 } };
 
-enum modes { LOUDNESS_MODE_SCAN, LOUDNESS_MODE_TAG, LOUDNESS_MODE_DUMP };
+enum modes {
+	LOUDNESS_MODE_SCAN,
+	LOUDNESS_MODE_TAG,
+	LOUDNESS_MODE_VERIFY,
+	LOUDNESS_MODE_DUMP,
+	LOUDNESS_MODE_MONITOR,
+	LOUDNESS_MODE_CHECK
+};
+
+/* "-" as only file argument reads one stream from stdin */
+static char stdin_name[] = "-";
+static struct filename_representations stdin_fr = { stdin_name, stdin_name };
+static struct filename_list_node stdin_node = { &stdin_fr, NULL };
+
+static gboolean
+parse_stdin_argument(int argc, char *argv[], int mode)
+{
+	int i;
+	gboolean found = FALSE;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], stdin_name)) {
+			found = TRUE;
+		}
+	}
+	if (!found) {
+		return FALSE;
+	}
+	if (argc - 1 != 1) {
+		fprintf(stderr,
+		    "Cannot read standard input together with other files\n");
+		exit(EXIT_FAILURE);
+	}
+	if (mode == LOUDNESS_MODE_TAG || mode == LOUDNESS_MODE_VERIFY) {
+		fprintf(stderr, "Cannot tag standard input\n");
+		exit(EXIT_FAILURE);
+	}
+	return TRUE;
+}
 
 int
 main(int argc, char *argv[])
 {
 	GSList *errors = NULL;
 	GSList *files = NULL;
-	Filetree tree;
+	Filetree tree = NULL;
 	int mode = 0;
 	int mode_parsed = FALSE;
 	int ret = 0;
+	gboolean read_stdin;
 
 	if (parse_global_args(&argc, &argv, entries, TRUE) || argc < 2 ||
 	    help) {
@@ -218,10 +424,19 @@ main(int argc, char *argv[])
 	} else if (!strcmp(argv[1], "tag")) {
 		mode = LOUDNESS_MODE_TAG;
 		mode_parsed = loudness_tag_parse(&argc, &argv);
+	} else if (!strcmp(argv[1], "verify")) {
+		mode = LOUDNESS_MODE_VERIFY;
+		mode_parsed = loudness_verify_parse(&argc, &argv);
 #endif
 	} else if (!strcmp(argv[1], "dump")) {
 		mode = LOUDNESS_MODE_DUMP;
 		mode_parsed = loudness_dump_parse(&argc, &argv);
+	} else if (!strcmp(argv[1], "monitor")) {
+		mode = LOUDNESS_MODE_MONITOR;
+		mode_parsed = loudness_monitor_parse(&argc, &argv);
+	} else if (!strcmp(argv[1], "check")) {
+		mode = LOUDNESS_MODE_CHECK;
+		mode_parsed = loudness_check_parse(&argc, &argv);
 	} else if (!strcmp(argv[1], "--version")) {
 		print_version();
 		exit(EXIT_SUCCESS);
@@ -235,21 +450,40 @@ main(int argc, char *argv[])
 		fprintf(stderr, "Cannot decode more than one file\n");
 		exit(EXIT_FAILURE);
 	}
+	read_stdin = parse_stdin_argument(argc, argv, mode);
+	if (prefetch_lookahead < 0 || prefetch_budget_mb <= 0) {
+		fprintf(stderr, "Invalid prefetch settings\n");
+		exit(EXIT_FAILURE);
+	}
+	if (raw_format) {
+		if (forced_plugin) {
+			fprintf(stderr, "Cannot force a plugin for raw input\n");
+			exit(EXIT_FAILURE);
+		}
+		if (input_set_raw_format(raw_format)) {
+			fprintf(stderr, "Invalid raw format '%s'\n", raw_format);
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	input_init(argv[0], forced_plugin);
 	scanner_init_common();
 
 	setlocale(LC_COLLATE, "");
 	setlocale(LC_CTYPE, "");
-	tree = filetree_init(&argv[1], (size_t)(argc - 1), recursive,
-	    follow_symlinks, no_sort, &errors);
+	if (read_stdin) {
+		files = g_slist_prepend(files, &stdin_node);
+	} else {
+		tree = filetree_init(&argv[1], (size_t)(argc - 1), recursive,
+		    follow_symlinks, no_sort, &errors);
 
-	g_slist_foreach(errors, filetree_print_error, &verbose);
-	g_slist_foreach(errors, filetree_free_error, NULL);
-	g_slist_free(errors);
+		g_slist_foreach(errors, filetree_print_error, &verbose);
+		g_slist_foreach(errors, filetree_free_error, NULL);
+		g_slist_free(errors);
 
-	filetree_file_list(tree, &files);
-	filetree_remove_common_prefix(files);
+		filetree_file_list(tree, &files);
+		filetree_remove_common_prefix(files);
+	}
 
 	switch (mode) {
 	case LOUDNESS_MODE_SCAN:
@@ -259,18 +493,32 @@ main(int argc, char *argv[])
 	case LOUDNESS_MODE_TAG:
 		ret = loudness_tag(files);
 		break;
+	case LOUDNESS_MODE_VERIFY:
+		ret = loudness_verify(files);
+		break;
 #endif
 	case LOUDNESS_MODE_DUMP:
 		ret = loudness_dump(files);
 		break;
+	case LOUDNESS_MODE_MONITOR:
+		ret = loudness_monitor(files);
+		break;
+	case LOUDNESS_MODE_CHECK:
+		ret = loudness_check(files);
+		break;
 	}
 
-	g_slist_foreach(files, filetree_free_list_entry, NULL);
+	if (read_stdin) {
+		g_free(stdin_node.d);
+	} else {
+		g_slist_foreach(files, filetree_free_list_entry, NULL);
+		filetree_destroy(tree);
+	}
 	g_slist_free(files);
 
-	filetree_destroy(tree);
 	input_deinit();
 	g_free(forced_plugin);
+	g_free(raw_format);
 
 	return ret;
 }